@@ -13,6 +13,11 @@
 #define VERSION "1.0.5"
 #define PROGNAME "bwview"
 
+#ifdef T_LINUX
+#define _FILE_OFFSET_BITS 64	// Large file support on 32-bit systems
+#define _GNU_SOURCE		// For fopencookie()
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -24,6 +29,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <limits.h>
 #include <SDL/SDL.h>
 #include <math.h>
 
@@ -32,12 +38,24 @@
 #include <sys/time.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef T_MSVC
 #include <float.h>
+#include <io.h>
 #define NAN nan_global
 #endif
 
 #ifdef T_LINUX
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glob.h>
+#include <zlib.h>
 //#include <sfftw.h>		// Single-precision version of fftw
 //#include <dfftw.h>
 //#include <drfftw.h>
@@ -80,6 +98,23 @@
 #define isnan(val) _isnan(val)
 #endif
 
+// 64-bit file positioning.  All file offsets are held as 'long long'
+// byte offsets from the start of the file.
+#ifdef T_LINUX
+#define FSEEK(fp, off) fseeko(fp, (off_t)(off), SEEK_SET)
+#define FTELL(fp) ((long long)ftello(fp))
+#endif
+
+#ifdef T_MINGW
+#define FSEEK(fp, off) fseeko64(fp, off, SEEK_SET)
+#define FTELL(fp) ftello64(fp)
+#endif
+
+#ifdef T_MSVC
+#define FSEEK(fp, off) _fseeki64(fp, off, SEEK_SET)
+#define FTELL(fp) _ftelli64(fp)
+#endif
+
 
 // With HEADER defined, these C files just give their header info
 // (mainly structure-definitions).  Perhaps this is bit unusual --
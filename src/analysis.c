@@ -23,7 +23,7 @@
 //
 //	// Create new analysis object
 //	BWAnal *aa;
-//	aa= bwanal_new(format, filename);	// Arguments as for bwfile_open()
+//	aa= bwanal_new(format, filenames, n_files);	// As for bwfile_open_parts()
 //
 //	while (...) {
 //	   // Specify parameters and start/restart calculations
@@ -48,10 +48,47 @@
 //	// see if any further data has been written to it
 //	bwanal_recheck_file(aa);
 //
+//	// Cheaply find out whether there is new data for a recheck to find
+//	if (bwanal_file_grown(aa)) ...
+//
 //	// Optionally find the total length of the file in samples (this implies 
-//	// scanning to the end of the file if this has not been done already)
+//	// scanning to the end of the file if this has not been done already).
+//	// For a pipe or other stream, this is the length read so far.
 //	int len= bwanal_length(aa);
 //
+//	// The file's block index is built in the background where possible,
+//	// so bwanal_length() can be avoided until it is done.  This gives -1
+//	// when there is no background indexing going on, else a percentage
+//	int pc= bwanal_index_progress(aa);
+//
+//	// Meanwhile, a view far beyond the indexed part of the file is
+//	// shown straight away from estimated positions.  This estimates the
+//	// length of the file (-1 if there's no need, use bwanal_length()).
+//	int len= bwanal_approx_length(aa);
+//
+//	// Check whether the current view came from estimated positions:
+//	// 0 no, 1 yes, 2 yes but the exact positions are known now, so
+//	// a new bwanal_start() will show the view properly
+//	int ap= bwanal_approx(aa);
+//
+//	// Find the next run of samples with errors after sample 'pos' (dir
+//	// > 0), or the last one before it (dir < 0), as far as the file
+//	// has been read or indexed so far.  Returns 0 if none found.
+//	int beg, end;
+//	if (bwanal_next_error(aa, pos, dir, &beg, &end)) ...
+//
+//	// Count the samples with errors in each of 'n' equal parts of the
+//	// file so far, returning the number of samples that covers
+//	int span= bwanal_error_density(aa, n, cnt);
+//
+//	// Find the next change of state on a switch or marker channel
+//	// after sample 'pos' (dir > 0), or the last one before it (dir
+//	// < 0), or get the changes from sample 'beg' to 'end-1', as far
+//	// as the file has been read or indexed so far
+//	int at, chan, val;
+//	if (bwanal_next_event(aa, pos, dir, &at, &chan, &val)) ...
+//	int n= bwanal_events(aa, beg, end, ev, max);
+//
 //	// Delete the analysis object when done (also shuts file)
 //	bwanal_del(aa);
 //
@@ -112,6 +149,8 @@ struct BWAnal {
    int n_blk;		// Number of blocks in list
    int bsiz;		// Block size
    int bnum;		// Number of block at front of list
+   char *want;		// Channels to have BWFile decode: want[chan]
+   int approx;		// Were any of the blocks read from estimated positions ?
    int half;		// Does this filter only require the left half of the data ? 0 no, 1 yes
 
    fftw_plan *plan;	// Big list of FFTW plans (see note below for ordering)
@@ -153,6 +192,10 @@ struct BWAnal {
 
 #define PLAN_SIZE(n) ((n)/3%2 ? 3 : 2) << ((n)/6)
 
+// Bytes of blocks no longer in use to keep cached in the BWFile, so
+// that scrolling back and forth doesn't have to decode them again
+#define BWANAL_CACHE (16<<20)
+
 #else
 
 #include "all.h"
@@ -212,6 +255,66 @@ load_data(BWAnal *aa, int siz) {
    aa->blk= blk;
    aa->n_blk= n_blk;
    aa->bnum= blk0;
+   aa->approx= 0;
+   for (a= 0; a<n_blk; a++)
+      if (blk[a] && blk[a]->approx) aa->approx= 1;
+
+   // Get the next lot coming in the background
+   bwfile_readahead(aa->file, blk0, blk1);
+}
+
+#ifdef __SSE2__
+
+//
+//	Convert 8 16-bit values to doubles, multiplying by 'scale' as
+//	floats, as BWBLOCK_VAL() does
+//
+
+static void 
+vconv_16(__m128i s, __m128 scale, double *out) {
+   __m128 f0= _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16)), scale);
+   __m128 f1= _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16)), scale);
+   _mm_storeu_pd(out, _mm_cvtps_pd(f0));
+   _mm_storeu_pd(out+2, _mm_cvtps_pd(_mm_movehl_ps(f0, f0)));
+   _mm_storeu_pd(out+4, _mm_cvtps_pd(f1));
+   _mm_storeu_pd(out+6, _mm_cvtps_pd(_mm_movehl_ps(f1, f1)));
+}
+
+#endif
+
+//
+//	Convert 'len' samples on channel 'chan' of block 'bb' starting
+//	at 'off' to doubles, whatever width the block is held at
+//
+
+static void 
+conv_samples(double *arr, BWBlock *bb, int chan, int off, int len) {
+   float scale= bb->scale;
+   int a= 0;
+
+   if (bb->chan[chan]) {
+      float *p= bb->chan[chan] + off;
+      for (; a<len; a++) arr[a]= p[a];
+   } else if (bb->ch16[chan]) {
+      short *p= bb->ch16[chan] + off;
+#ifdef __SSE2__
+      __m128 vscale= _mm_set1_ps(scale);
+      for (; a + 8 <= len; a += 8)
+	 vconv_16(_mm_loadu_si128((__m128i *)(p + a)), vscale, arr + a);
+#endif
+      for (; a<len; a++) arr[a]= p[a] * scale;
+   } else {
+      signed char *p= bb->ch8[chan] + off;
+#ifdef __SSE2__
+      __m128 vscale= _mm_set1_ps(scale);
+      for (; a + 16 <= len; a += 16) {
+	 __m128i b= _mm_loadu_si128((__m128i *)(p + a));
+	 vconv_16(_mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8), vscale, arr + a);
+	 vconv_16(_mm_srai_epi16(_mm_unpackhi_epi8(b, b), 8), vscale, arr + a + 8);
+      }
+#endif
+      for (; a<len; a++) arr[a]= p[a] * scale;
+   }
 }
 
 //
@@ -219,11 +322,14 @@ load_data(BWAnal *aa, int siz) {
 //	array.  Zeros are inserted for data before the beginning of
 //	the file or after the end.  If the 'errors' flag is set, then
 //	any sync errors result in NAN values in the output array.
+//	Returns 1 if there might be NANs in the output (from errors, or
+//	in float data), or 0 if there can't be.
 //
 
-static void 
+static int 
 copy_samples(BWAnal *aa, double *arr, int off, int chan, int len, int errors) {
    int bsiz= aa->bsiz;
+   int nan= 0;
 
    DEBUG("Copy samples: off %d, len %d, end %d", off, len, off+len);
 
@@ -244,13 +350,25 @@ copy_samples(BWAnal *aa, double *arr, int off, int chan, int len, int errors) {
 	 error("Internal error -- block not loaded: %d", num);
 
       // Copy as much as possible from the block
-      if (bb= aa->blk[num]) {
-	 int siz= bb->len;
-	 while (len > 0 && boff < siz) {
-	    *arr++= bb->chan[chan][boff];
-	    if (errors && bb->err[boff]) arr[-1]= NAN;
-	    len--; boff++; off++;
+      if ((bb= aa->blk[num]) && boff < bb->len) {
+	 int cnt= bb->len - boff;
+	 if (cnt > len) cnt= len;
+	 conv_samples(arr, bb, chan, boff, cnt);
+	 if (bb->chan[chan]) nan= 1;
+
+	 // Clean blocks (the usual case) need nothing more
+	 if (errors && bb->n_err) {
+	    int a, b, r;
+	    for (r= 0; r<bb->n_err_run; r++) {
+	       a= bb->err_run[r].beg;
+	       b= bb->err_run[r].end;
+	       if (a < boff) a= boff;
+	       if (b > boff + cnt) b= boff + cnt;
+	       for (; a<b; a++) arr[a - boff]= NAN;
+	    }
+	    nan= 1;
 	 }
+	 arr += cnt; len -= cnt; boff += cnt; off += cnt;
       }
 
       // Fill in the remainder of the block with zeros
@@ -259,6 +377,7 @@ copy_samples(BWAnal *aa, double *arr, int off, int chan, int len, int errors) {
 	 len--; boff++; off++;
       }
    }
+   return nan;
 }
 
 //
@@ -339,18 +458,22 @@ sincos_step(double *buf) {
 
 
 //
-//	Create a new analysis object for the given file 'fnam'.  The
-//	file is loaded with format 'fmt' (see BWFile).
+//	Create a new analysis object for the given file fnam[0], or
+//	for a recording split into files fnam[0] to fnam[n_fnam-1].
+//	The file is loaded with format 'fmt' (see BWFile).
 //
 
 BWAnal *
-bwanal_new(char *fmt, char *fnam) {
+bwanal_new(char *fmt, char **fnam, int n_fnam) {
    BWAnal *aa= ALLOC(BWAnal);
 
    aa->bsiz= 1024;
-   aa->file= bwfile_open(fmt, fnam, aa->bsiz, 0);
+   aa->file= bwfile_open_parts(fmt, fnam, n_fnam, aa->bsiz, BWANAL_CACHE);
    aa->n_chan= aa->file->chan;
    aa->rate= aa->file->rate;
+   aa->want= ALLOC_ARR(aa->n_chan, char);
+   bwfile_index_start(aa->file);
+   bwfile_approx(aa->file, 1);
    
    // Put a few safe values in place just in case
    aa->req.tbase= 1;
@@ -394,6 +517,13 @@ bwanal_start(BWAnal *aa) {
    if (analtyp < 0 || analtyp > 2) 
       error("Bad analysis type value %d in bwanal_start", aa->c.typ);
    aa->half= analtyp != 0;
+
+   // Only the channel being displayed needs decoding
+   if (aa->c.chan < 0 || aa->c.chan >= aa->n_chan)
+      error("Bad channel number %d in bwanal_start", aa->c.chan);
+   memset(aa->want, 0, aa->n_chan);
+   aa->want[aa->c.chan]= 1;
+   bwfile_want(aa->file, aa->want);
    
    // Work everything out from scratch (no clever partial calculations
    // for half-page scrolls or anything like that for now).
@@ -506,6 +636,109 @@ bwanal_start(BWAnal *aa) {
    aa->yy= 0;
 }
 
+//
+//	Get a single sample in the same way as copy_samples(), i.e. 0
+//	outside the file, or NAN for sync errors
+//
+
+static double 
+get_sample(BWAnal *aa, int off, int chan) {
+   BWBlock *bb;
+   int num;
+
+   if (off < 0) return 0;
+   num= off / aa->bsiz - aa->bnum;
+   if (num < 0 || num >= aa->n_blk)
+      error("Internal error -- block not loaded: %d", num);
+   off %= aa->bsiz;
+   bb= aa->blk[num];
+   if (!bb || off >= bb->len) return 0;
+   return BWBLOCK_ERR(bb, off) ? NAN : BWBLOCK_VAL(bb, chan, off);
+}
+
+//
+//	Fill in the ->sig arrays from the original signal without
+//	copying out all the samples.  At large time-bases most of each
+//	column is made up of whole blocks, and the range of values
+//	across these comes from the BWFile min/max pyramid.  The
+//	results are exactly the same as the general code in
+//	bwanal_window() gives.
+//
+
+static void 
+signal_pyramid(BWAnal *aa) {
+   int sx= aa->c.sx;
+   int tbase= aa->c.tbase;
+   int bsiz= aa->bsiz;
+   int chan= aa->c.chan;
+   int a;
+
+   for (a= 0; a<sx; a++) {
+      int off= aa->c.off + a * tbase;
+      int end= off + tbase;
+      double min= HUGE_VAL;
+      double max= -HUGE_VAL;
+      double mid= get_sample(aa, off + tbase/2, chan);
+      int nan= isnan(mid);
+
+      // Zeros before start of file
+      if (off < 0) {
+	 min= max= 0;
+	 off= (end < 0) ? end : 0;
+      }
+
+      while (off < end && !nan) {
+	 int num= off / bsiz;
+	 int boff= off - num * bsiz;
+	 int lim= boff + (end - off);
+	 BWBlock *bb;
+	 float lo, hi;
+	 int n1, rv;
+
+	 if (num - aa->bnum < 0 || num - aa->bnum >= aa->n_blk)
+	    error("Internal error -- block not loaded: %d", num - aa->bnum);
+	 bb= aa->blk[num - aa->bnum];
+
+	 // Take a run of whole blocks from the pyramid if possible
+	 if (boff == 0) {
+	    for (n1= num; (n1+1) * bsiz <= end && n1 - aa->bnum < aa->n_blk; n1++) 
+	       if (!aa->blk[n1 - aa->bnum] || aa->blk[n1 - aa->bnum]->len != bsiz) 
+		  break;
+	    if (n1 > num && 
+		(rv= bwfile_range(aa->file, chan, num, n1, &lo, &hi))) {
+	       if (rv == 2) nan= 1;
+	       if (lo < min) min= lo;
+	       if (hi > max) max= hi;
+	       off= n1 * bsiz;
+	       continue;
+	    }
+	 }
+
+	 // Otherwise go through the samples in this block
+	 if (lim > bsiz) lim= bsiz;
+	 for (; boff < lim; boff++, off++) {
+	    float val= 0;
+	    if (bb && boff < bb->len) {
+	       val= BWBLOCK_VAL(bb, chan, boff);
+	       if (BWBLOCK_ERR(bb, boff) || isnan(val)) { nan= 1; break; }
+	    }
+	    if (val < min) min= val;
+	    if (val > max) max= val;
+	 }
+      }
+
+      if (nan) {
+	 aa->sig[a]= NAN;
+	 aa->sig0[a]= NAN;
+	 aa->sig1[a]= NAN;
+      } else {
+	 aa->sig[a]= mid;
+	 aa->sig0[a]= min;
+	 aa->sig1[a]= max;
+      }
+   }
+}
+
 //
 //	Fill the aa->sig signal arrays with data, either from the
 //	original untouched signal, or from one modified by the window
@@ -524,12 +757,21 @@ bwanal_window(BWAnal *aa, int xx, int yy) {
    int sx= aa->c.sx;
    int tbase= aa->c.tbase;
    int len= sx * tbase;
-   double *tmp= ALLOC_ARR(len, double);
+   double *tmp;
    int wind= yy >= 0 && xx >= 0;	// Are we applying a window ?
+   int may_nan;			// Might there be NANs in tmp[] ?
 
    aa->sig_wind= wind;
 
-   copy_samples(aa, tmp, aa->c.off, aa->c.chan, len, 1);
+   // Plain signal at large time-bases (at least one whole block per
+   // column) can avoid going through every sample
+   if (!wind && tbase >= 2 * aa->bsiz) {
+      signal_pyramid(aa);
+      return;
+   }
+
+   tmp= ALLOC_ARR(len, double);
+   may_nan= copy_samples(aa, tmp, aa->c.off, aa->c.chan, len, 1);
 
    // Apply window to tmp[] if required, and store window in ->sig[]
    if (wind) {
@@ -590,7 +832,7 @@ bwanal_window(BWAnal *aa, int xx, int yy) {
       if (!wind) aa->sig[a]= tmp[b + tbase/2];
       for (c= tbase; c>0; c--) {
 	 float val= tmp[b++];
-	 if (isnan(val)) nan= 1;
+	 if (may_nan && isnan(val)) nan= 1;
 	 if (val < min) min= val;
 	 if (val > max) max= val;
       }
@@ -769,6 +1011,7 @@ bwanal_del(BWAnal *aa) {
 
    bwfile_close(aa->file);
    if (aa->blk) free(aa->blk);
+   free(aa->want);
 
    for (a= 0; a<aa->m_plan; a++) {
       if (aa->plan[a]) {
@@ -816,24 +1059,37 @@ bwanal_recheck_file(BWAnal *aa) {
    }
 }
 
+//
+//	Check whether more data has been written to the file since it
+//	was last rechecked.  This is cheap enough to call often.
+//
+
+int 
+bwanal_file_grown(BWAnal *aa) {
+   return bwfile_grown(aa->file);
+}
+
 //
 //	Find the size of the file in samples.  This means scanning all
 //	the way to the end of the file if we have not already gone
-//	that far.
+//	that far.  A stream can't be scanned ahead, so for that we
+//	give the length read so far.
 //
 
 int 
 bwanal_length(BWAnal *aa) {
    BWFile *ff= aa->file;
-   BWBlock *bb;
 
    bwanal_recheck_file(aa);
+   if (ff->stream)
+      return bwfile_stream_len(ff);
+
+   // Let the background index builder do the scanning if it can, as
+   // it will be faster than doing it here
+   bwfile_index_start(ff);
+   bwfile_index_wait(ff);
    
-   while (!ff->eof) {
-      bb= bwfile_get(ff, ff->n_blk);
-      if (!bb) break;
-      bwfile_free(ff, bb);
-   }
+   bwfile_find_end(ff);
 
    if (!ff->eof || ff->len < 0) 
       error("Internal error in bwanal_length()");
@@ -842,6 +1098,86 @@ bwanal_length(BWAnal *aa) {
 }
 
 
+//
+//	Check on the progress of background indexing of the file.
+//	Returns -1 if there is none going on (so bwanal_length() will
+//	be quick if the file has been indexed to the end), else a
+//	percentage 0-99.
+//
+
+int 
+bwanal_index_progress(BWAnal *aa) {
+   return bwfile_index_progress(aa->file);
+}
+
+//
+//	Estimate the length of the file while it is still being
+//	indexed.  Returns -1 if bwanal_length() should be used instead.
+//
+
+int 
+bwanal_approx_length(BWAnal *aa) {
+   return bwfile_approx_len(aa->file);
+}
+
+//
+//	Check whether any of the data for the current view was read
+//	from estimated file positions.  Returns 0 if not, 1 if so, or
+//	2 if so but the exact positions are now known for some of it.
+//
+
+int 
+bwanal_approx(BWAnal *aa) {
+   int a;
+
+   if (!aa->approx) return 0;
+   for (a= 0; a<aa->n_blk; a++)
+      if (aa->blk[a] && aa->blk[a]->approx && bwfile_exact(aa->file, aa->blk[a]->num))
+	 return 2;
+   return 1;
+}
+
+//
+//	Find the next or previous run of errors in the file, as far as
+//	it has been read or indexed so far.  Returns 0 if none found.
+//
+
+int 
+bwanal_next_error(BWAnal *aa, int pos, int dir, int *begp, int *endp) {
+   return bwfile_next_error(aa->file, pos, dir, begp, endp);
+}
+
+//
+//	Count the samples with errors in each of 'n' equal parts of the
+//	file so far.  Returns the number of samples covered.
+//
+
+int 
+bwanal_error_density(BWAnal *aa, int n, int *cnt) {
+   return bwfile_error_density(aa->file, n, cnt);
+}
+
+//
+//	Find the next change of state on a switch channel after sample
+//	'pos' (dir > 0), or the last one before it (dir < 0).  Returns
+//	0 if there isn't one in the part of the file covered so far.
+//
+
+int 
+bwanal_next_event(BWAnal *aa, int pos, int dir, int *posp, int *chanp, int *valp) {
+   return bwfile_next_event(aa->file, pos, dir, posp, chanp, valp);
+}
+
+//
+//	Get the changes of state on switch channels from sample 'beg'
+//	to 'end-1', up to 'max' of them.  Returns the number found.
+//
+
+int 
+bwanal_events(BWAnal *aa, int beg, int end, BWEvt *ev, int max) {
+   return bwfile_events(aa->file, beg, end, ev, max);
+}
+
 // 
 //	Load up saved 'wisdom' file if it exists
 //
@@ -63,7 +63,12 @@ int restart;		// Set to request a restart of the calculations
 int redraw;		// Set to request a redraw of the screen
 int part_cmd= 0;	// Partial command status, or 0
 int opt_x= 0;		// Option -x set to enable IIR modes
-int follow_tmo;		// Time at which next 'follow-mode' update is required
+int opt_T= 0;		// Option -T set to transcode instead of viewing
+int opt_I= 0;		// Option -I set to transcode to int16 columns
+char *opt_P= 0;		// Option -P socket to send the file to, or 0
+int follow_tmo;		// Earliest time for the next 'follow-mode' update
+int pend_end= -1;	// Jump to end waiting on file indexing: last percentage shown, or -1
+int approx_tmo;		// Earliest time to check again whether an approximate view can be fixed
 
 
 // Hacks
@@ -104,8 +109,16 @@ usage() {
 	 NL "FFTW: Copyright (c) 1997-1999 Massachusetts Institute of Technology,"
 	 NL "  released under the GNU GPL; see http://www.fftw.org/"
 	 NL
-	 NL "Usage: bwview [options] <file-format> <filename>"
+	 NL "Usage: bwview [options] <file-format> <filename> [<filename> ...]"
+	 NL "       bwview -T [-I] <file-format> <filename> <output.bwc>"
+	 NL "       bwview -P <socket> <file-format> <filename>"
 	 NL "See output of option -f for a list of supported formats"
+	 NL "<filename> may be '-' for stdin, a FIFO, or 'unix:<path>' to listen on"
+	 NL "a Unix-domain socket, which are read as a live stream keeping only the"
+	 NL "most recent data in memory"
+	 NL "A gzip-compressed file is decompressed on the fly"
+	 NL "Several filenames (or a quoted wildcard pattern) are read as the parts"
+	 NL "of one recording split into several files, as if joined with 'cat'"
 	 NL
 	 NL "Options:"
 	 NL "  -f            Display list of all supported file formats"
@@ -114,6 +127,11 @@ usage() {
 	 NL "                <bpp> may be 16 or 32.  For example: 800x600x16"
 	 NL "  -W <size>     Run as a window with the given size: <wid>x<hgt>"
 	 NL "  -x            Enable 'x' key to select IIR testing modes"
+	 NL "  -T            Transcode the file into a native 'bwc' file, which can"
+	 NL "                be viewed later without any scanning or decoding"
+	 NL "  -I            With -T, store 16-bit integers instead of floats"
+	 NL "  -P <socket>   Send the file to a viewer listening on 'unix:<socket>',"
+	 NL "                at the rate it was recorded (for testing)"
 	 );
 }
 
@@ -154,7 +172,7 @@ int
 main(int ac, char **av) {
    char *cmd= 0;
    char *p;
-   char *fmt, *fnam;
+   char *fmt;
    int sx= 640, sy= 480, bpp= 0;	// Default is 640x480 resizable window
    BWAnal *aa;
    SDL_Event ev;
@@ -190,11 +208,31 @@ main(int ac, char **av) {
 	  break;
        case 'x':
 	  opt_x= 1; break;
+       case 'T':
+	  opt_T= 1; break;
+       case 'I':
+	  opt_I= 1; break;
+       case 'P':
+	  if (ac-- < 1) usage();
+	  opt_P= *av++;
+	  break;
        default:	
 	  error("Unknown option '%c'", ch);
       }
    }
 
+   // Transcoding doesn't need anything else set up
+   if (opt_T) {
+      if (ac != 3) usage();
+      bwfile_transcode(av[0], av[1], av[2], opt_I);
+      exit(0);
+   }
+   if (opt_P) {
+      if (ac != 2) usage();
+      bwfile_push(av[0], av[1], opt_P);
+      exit(0);
+   }
+
    // Read in config file and initialise settings globals
    config_load("bwview.cfg");
    set_init();
@@ -202,11 +240,22 @@ main(int ac, char **av) {
    // Load up any FFTW wisdom
    bwanal_load_wisdom("bwview.wis");
 
-   // Open file  (the bwanal_new call will drop dead if there are any problems)
-   if (ac != 2) usage();
-   fmt= *av++;
-   fnam= *av++;
-   aa= bwanal_new(fmt, fnam);
+   // Open file  (the bwanal_new call will drop dead if there are any problems).
+   // Several filenames are parts of one recording, to be joined.  A
+   // quoted wildcard pattern is expanded here, in name order.
+   if (ac < 2) usage();
+   fmt= *av++; ac--;
+#ifdef T_LINUX
+   {
+      glob_t gl;
+      if (ac == 1 && strpbrk(av[0], "*?[") && 0 != access(av[0], F_OK) &&
+	  0 == glob(av[0], 0, 0, &gl)) {
+	 av= gl.gl_pathv;
+	 ac= gl.gl_pathc;
+      }
+   }
+#endif
+   aa= bwanal_new(fmt, av, ac);
 
    // Initialize SDL
    if (0 > SDL_Init(SDL_INIT_VIDEO | SDL_INIT_NOPARACHUTE))            // 
@@ -295,15 +344,29 @@ main(int ac, char **av) {
 	 redraw= 0;
       }
 
-      // Follow-mode handling
+      // Jump to the end once the file has been indexed
+      if (pend_end >= 0) 
+	 goto_end(aa);
+
+      // Redo a view shown from estimated positions as soon as the
+      // exact ones are known, checking 10 times a second
+      if (aa->approx) {
+	 int now= SDL_GetTicks();
+	 if (now - approx_tmo >= 0) {
+	    if (bwanal_approx(aa) == 2) restart= 1;
+	    approx_tmo= now + 100;
+	 }
+      }
+
+      // Follow-mode handling: jump to the end as soon as more data
+      // has been written, but not more than 10 times a second
       if (s_follow) {
 	 int now= SDL_GetTicks();
-	 if (now - follow_tmo >= 0) {
-	    s_off= bwanal_length(aa) - d_mag_sx * s_tbase * 7 / 8; 
-	    if (s_off < 0) s_off= 0;
-	    restart= 1;
-	    status("Following ... (Press shift-F to turn off)");
-	    follow_tmo= now + 1000;
+	 if (now - follow_tmo >= 0 && bwanal_file_grown(aa)) {
+	    goto_end(aa);
+	    if (pend_end < 0)
+	       status("Following ... (Press shift-F to turn off)");
+	    follow_tmo= now + 100;
 	    continue;
 	 }
       }
@@ -315,8 +378,8 @@ main(int ac, char **av) {
 	 bwanal_calc(aa);
 	 draw_mag_lines(aa, yy, aa->yy-yy);
       } else {
-	 if (s_follow)
-	    SDL_Delay(10);	// Wait 10ms if following
+	 if (s_follow || pend_end >= 0 || aa->approx)
+	    SDL_Delay(10);	// Wait 10ms if following or indexing
 	 else if (!SDL_WaitEvent(0)) 
 	    errorSDL("Unexpected error waiting for events");
       }
@@ -356,13 +419,12 @@ main(int ac, char **av) {
 		 restart= 1;
 		 break;
 	      case SDLK_HOME:
+		 pend_end= -1;
                  s_off= 0;
                  restart= 1;
                  break;
 	      case SDLK_END:
-                 s_off= bwanal_length(aa) - d_mag_sx * s_tbase * 7 / 8; 
-		 if (s_off < 0) s_off= 0;
-                 restart= 1;
+		 goto_end(aa);
                  break;
 	      case SDLK_UP:
 		 set_incdec(aa, 0, -1);
@@ -386,6 +448,13 @@ main(int ac, char **av) {
 		show_mag_status(aa, ev.motion.x - d_mag_xx, ev.motion.y - d_mag_yy);
 	     break;
 	  case SDL_MOUSEBUTTONDOWN:
+	     if (ev.motion.x >= d_tim_xx &&
+		 ev.motion.x - d_tim_xx < d_tim_sx &&
+		 ev.motion.y >= d_tim_yy &&
+		 ev.motion.y - d_tim_yy < d_tim_sy) {
+		goto_frac(aa, (ev.motion.x - d_tim_xx) / (double)d_tim_sx);
+		break;
+	     }
 	     if (ev.motion.x >= d_mag_xx &&
 		 ev.motion.x - d_mag_xx < d_mag_sx &&
 		 ev.motion.y >= d_mag_yy &&
@@ -433,14 +502,22 @@ exec_key(BWAnal *aa, int key) {
        case 'Q':
 	  exit(0);
        case 'F':
-	  follow_tmo= SDL_GetTicks() + 1000;	// 1 sec from now
+	  follow_tmo= SDL_GetTicks() + 100;
 	  s_follow= !s_follow;
 	  status("Follow mode %s", s_follow ? "ON" : "OFF");
-	  if (s_follow) {
-	     s_off= bwanal_length(aa) - d_mag_sx * s_tbase * 7 / 8; 
-	     if (s_off < 0) s_off= 0;
-	     restart= 1;
-	  }
+	  if (s_follow) goto_end(aa);
+	  return;
+       case 'E':
+	  goto_error(aa, 1);
+	  return;
+       case 'W':
+	  goto_error(aa, -1);
+	  return;
+       case 'T':
+	  goto_event(aa, 1);
+	  return;
+       case 'R':
+	  goto_event(aa, -1);
 	  return;
        case 'O':
 	  status("Optimising FFTs -- this may take a while ...");
@@ -487,6 +564,101 @@ exec_key(BWAnal *aa, int key) {
    }
 }
 
+//
+//	Jump to the end of the file.  If the file is still being
+//	indexed in the background, don't sit waiting for it -- just
+//	show the progress on the status line.  The main loop keeps
+//	calling this until the indexing is done.
+//
+
+void 
+goto_end(BWAnal *aa) {
+   int pc= bwanal_index_progress(aa);
+   int len;
+
+   if (pc >= 0) {
+      // Show roughly where the end is meanwhile, if possible
+      if (pend_end < 0 && (len= bwanal_approx_length(aa)) >= 0) {
+	 s_off= len - d_mag_sx * s_tbase * 7 / 8; 
+	 if (s_off < 0) s_off= 0;
+	 restart= 1;
+      }
+      if (pc != pend_end) 
+	 status("Indexing file ... %d%%", pc);
+      pend_end= pc;
+      return;
+   }
+   if (pend_end >= 0) status("");
+   pend_end= -1;
+
+   s_off= bwanal_length(aa) - d_mag_sx * s_tbase * 7 / 8; 
+   if (s_off < 0) s_off= 0;
+   restart= 1;
+}
+
+//
+//	Jump to a point a fraction 'frac' of the way through the whole
+//	file, centred on the display.  If the file is still being
+//	indexed, this uses an estimate of its length, and the view is
+//	shown from estimated positions until the index catches up.
+//
+
+void 
+goto_frac(BWAnal *aa, double frac) {
+   int len= bwanal_approx_length(aa);
+
+   if (len < 0) len= bwanal_length(aa);
+   pend_end= -1;
+   s_off= (int)(frac * len) - d_mag_sx * s_tbase / 2;
+   if (s_off < 0) s_off= 0;
+   status("Jumped to %.3f s", s_off / aa->rate);
+   restart= 1;
+}
+
+//
+//	Jump to the next run of errors in the file (dir > 0), or the
+//	previous one (dir < 0), putting its start 1/8 of the way across
+//	the display.  This only knows about the part of the file that
+//	has been read or indexed so far.
+//
+
+void 
+goto_error(BWAnal *aa, int dir) {
+   int mark= d_mag_sx * s_tbase / 8;
+   int beg, end;
+
+   if (!bwanal_next_error(aa, s_off + mark, dir, &beg, &end)) {
+      status("No %s errors found in the file so far", dir > 0 ? "later" : "earlier");
+      return;
+   }
+   status("Errors at %.3f s, %d sample%s", beg / aa->rate, end - beg, 
+	  end - beg == 1 ? "" : "s");
+   s_off= beg - mark;
+   if (s_off < 0) s_off= 0;
+   restart= 1;
+}
+
+//
+//	Jump to the next change on a switch channel (dir > 0), or the
+//	previous one (dir < 0), in the same way as goto_error()
+//
+
+void 
+goto_event(BWAnal *aa, int dir) {
+   int mark= d_mag_sx * s_tbase / 8;
+   int pos, chan, val;
+
+   if (!bwanal_next_event(aa, s_off + mark, dir, &pos, &chan, &val)) {
+      status("No %s switch events found in the file so far", dir > 0 ? "later" : "earlier");
+      return;
+   }
+   status("Event at %.3f s, channel %d switched %s", pos / aa->rate, chan, 
+	  val ? "ON" : "OFF");
+   s_off= pos - mark;
+   if (s_off < 0) s_off= 0;
+   restart= 1;
+}
+
 //
 //	Show details corresponding to the current mouse position, for example:
 //
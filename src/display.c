@@ -237,6 +237,67 @@ draw_signal(BWAnal *aa) {
    update(d_sig_xx, d_sig_yy, d_sig_sx, d_sig_sy);
 }
       
+//
+//	Draw a strip along the bottom of the time-line showing where
+//	the errors are across the whole of the file read or indexed so
+//	far (dark red where there are a few, bright red where they are
+//	dense), with a marker above it for the part being displayed.
+//	Nothing is shown if no errors have been found.
+//
+
+static int *err_cnt= 0;
+static int err_cnt_n= 0;
+
+static void 
+draw_err_strip(BWAnal *aa) {
+   int sx= d_tim_sx;
+   int yy= d_tim_yy + d_tim_sy - 2;
+   int a, x0, x1, span, any= 0;
+   double per;
+
+   if (err_cnt_n < sx) {
+      if (err_cnt) free(err_cnt);
+      err_cnt= ALLOC_ARR(sx, int);
+      err_cnt_n= sx;
+   }
+   span= bwanal_error_density(aa, sx, err_cnt);
+   for (a= 0; a<sx; a++) any |= err_cnt[a];
+   if (!any) return;
+
+   per= span / (double)sx;	// Samples per pixel
+   for (a= 0; a<sx; a++) 
+      if (err_cnt[a])
+	 vline(d_tim_xx + a, yy, 2, colour[err_cnt[a] >= per / 10 ? 8 : 26]);
+
+   x0= (int)(aa->c.off / per);
+   x1= (int)((aa->c.off + aa->c.sx * aa->c.tbase) / per) + 1;
+   if (x1 > sx) x1= sx;
+   if (x0 < x1) clear_rect(d_tim_xx + x0, yy - 1, x1 - x0, 1, colour[9]);
+}
+
+//
+//	Draw a tick down from the top of the time-line at each change on
+//	a switch channel in the part being displayed, yellow for ON and
+//	grey for OFF.  These come from the event index, so nothing has
+//	to be decoded.
+//
+
+#define EVT_MAX 512		// Most ticks to draw
+
+static void 
+draw_evt_ticks(BWAnal *aa) {
+   BWEvt ev[EVT_MAX];
+   int per= aa->c.tbase;	// Samples per pixel
+   int a, n;
+
+   n= bwanal_events(aa, aa->c.off, aa->c.off + aa->c.sx * per, ev, EVT_MAX);
+   for (a= 0; a<n; a++) {
+      int xx= (ev[a].pos - aa->c.off) / per;
+      if (xx >= d_tim_sx) continue;
+      vline(d_tim_xx + xx, d_tim_yy, d_tim_sy/2, colour[ev[a].val ? 19 : 15]);
+   }
+}
+
 //
 //	Draw time-line based on given analysis object
 //
@@ -274,6 +335,16 @@ draw_timeline(BWAnal *aa) {
       off += step;
    }
 
+   draw_err_strip(aa);
+   draw_evt_ticks(aa);
+
+   // Mark a view shown from estimated file positions
+   if (aa->approx) {
+      char *txt= "\x8A APPROXIMATE POSITION \x80";
+      int wid= (strlen(txt) - 2) * (disp_font == 16 ? 8 : 6);
+      drawtext(disp_font, d_tim_xx + d_tim_sx - wid, d_tim_yy, txt);
+   }
+
    // Update
    update(d_tim_xx, d_tim_yy, d_tim_sx, d_tim_sy);
 }
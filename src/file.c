@@ -13,10 +13,10 @@
 //	indicated by the underlying format code so that this
 //	information can be shown to the user.
 //
-//	(TODO: It also allows a new file to be created for writing.
-//	Samples are always added to the end of the file, but the read
-//	functions can scan backwards and forwards independent of the
-//	writing functions.)
+//	It also allows a new file to be created for writing.  Samples
+//	are always added to the end of the file, but the read functions
+//	can scan backwards and forwards independent of the writing
+//	functions, and see the new samples as soon as they are added.
 //
 //	For reading, all data is converted to 32-bit floating point
 //	numbers.  Integer input data is scaled so that the integer
@@ -32,35 +32,149 @@
 //	Typical usage:
 //	-------------
 //
-//	// Open a file with block-size == 1024, max-unref == 20
+//	// Open a file with block-size == 1024, keeping up to 4MB of
+//	// unreferenced blocks cached
 //	BWFile *ff;
-//	ff= bwfile_open(format, filename, 1024, 20);
+//	ff= bwfile_open(format, filename, 1024, 4<<20);
+//
+//	// Or open a recording split into several files as if they had
+//	// been joined into one (see file_parts.inc)
+//	ff= bwfile_open_parts(format, filenames, n_files, 1024, 4<<20);
 //
 //	ff->rate;		// Sample rate of file
 //	ff->chan;		// Number of channels in the file
 //	ff->len;		// Length of file in samples, or -1 if not reached yet
 //
+//	// A filename of "-" means stdin, and "unix:<path>" listens on a
+//	// Unix-domain socket.  These, pipes, FIFOs and anything else
+//	// that isn't a regular file are read as a stream in the
+//	// background, keeping only the most recent blocks
+//	ff->stream;		// Reading a stream ?
+//	ff->ring_first;		// First block still available from a stream
+//	int len= bwfile_stream_len(ff);	// Samples read from a stream so far
+//
+//	// A gzip-compressed file is decompressed as it is read, and
+//	// can still be read in any order (see file_gzip.inc)
+//	ff->gz;			// Decompression state, or 0 if not compressed
+//
 //	// Get a random block from a file
 //	BWBlock *bb;
 //	bb= bwfile_get(ff, block_number);	// Block numbers count from 0
 //
 //	bb->len;		// Number of samples in this block (normally 1024, but 
 //				// less if this is the last block.
-//	bb->chan[n][];		// Array of float data for channel 'n' (0..(ff->chan-1))
-//	bb->err[];		// Array of error flags for the data: 0 no error, 1 sync error
+//	bb->chan[n][];		// Array of float data for channel 'n' (0..(ff->chan-1)),
+//				// or 0 if the channel is held at the file's native width:
+//	bb->ch16[n][];		// Array of 16-bit data for channel 'n', or 0
+//	bb->ch8[n][];		// Array of 8-bit data for channel 'n', or 0
+//	bb->scale;		// Multiplier to convert ch16[] or ch8[] values to floats
+//	BWBLOCK_VAL(bb, n, a);	// Get sample 'a' of channel 'n' as a float, whichever way
+//	BWBLOCK_HAS(bb, n);	// Has channel 'n' been decoded into this block ?
+//	BWBLOCK_ERR(bb, a);	// Does sample 'a' have an error (e.g. sync error) ?
 //				// It is intended that these errors should be indicated on 
 //				// the user display.
+//	bb->n_err;		// Number of samples with errors, 0 for a clean block
+//	bb->err_run[];		// Runs of samples with errors, as offsets into the block
+//	bb->n_err_run;		// Number of entries in bb->err_run[]
+//	bb->approx;		// Read from an estimated position (see bwfile_approx() below)
 //
 //	// Release a block no longer needed
 //	bwfile_free(ff, bb);	// Don't access bb->??? after this point
 //
+//	// Only decode some of the channels into blocks from now on, e.g.
+//	// the one being displayed (want[] has ff->chan entries, or pass 0
+//	// for all).  Blocks already cached get any channels they are
+//	// missing filled in when they are next fetched with bwfile_get().
+//	bwfile_want(ff, want);
+//
+//	// Note which blocks are in use for display, so that the ones
+//	// following on in the same direction can be read ahead in the
+//	// background
+//	bwfile_readahead(ff, first_block, last_block_plus_one);
+//
+//	// Read blocks in another thread, e.g. for a batch job, without
+//	// going through the cache.  Blocks already indexed are decoded
+//	// at the same time as those in other threads (see
+//	// file_reader.inc).  Each thread needs its own BWRdr.
+//	BWRdr *rd= bwfile_reader(ff);
+//	bb= bwfile_read(ff, rd, block_number);
+//	bwfile_read_free(bb);
+//	bwfile_reader_free(rd);
+//
+//	// Scan through to the end of the file, to get ff->len.  This only
+//	// steps over the data without decoding it, where the format allows.
+//	bwfile_find_end(ff);
+//
+//	ff->c_hit;		// Cache statistics: blocks found in cache,
+//	ff->c_miss;		// blocks that had to be read from the file,
+//	ff->c_evict;		// and unreferenced blocks thrown out of the cache
+//
+//	// Get the range of values on a channel across a span of whole
+//	// blocks, as far as they've been decoded: 0 not known, 1 ok,
+//	// 2 ok but there are errors in there too
+//	float min, max;
+//	int rv= bwfile_range(ff, chan, first_block, last_block_plus_one, &min, &max);
+//
+//	// Find the next run of samples with errors after sample 'pos'
+//	// (dir > 0), or the last one before it (dir < 0), as far as
+//	// the file has been read through so far.  0 if there isn't one.
+//	int beg, end;
+//	if (bwfile_next_error(ff, pos, dir, &beg, &end)) ...
+//
+//	// Count the samples with errors in each of 'n' equal parts of
+//	// the file so far, returning the number of samples covered
+//	int span= bwfile_error_density(ff, n, cnt);
+//
+//	// For formats with switch or marker channels (ff->n_sw of them,
+//	// from channel ff->sw_chan), find the next change of state
+//	// after sample 'pos' (dir > 0) or the last one before it (dir <
+//	// 0), or get the changes from sample 'beg' to 'end-1' (see
+//	// file_events.inc).  Again, only as far as the file has been
+//	// read through so far.
+//	int at, ch, val;
+//	if (bwfile_next_event(ff, pos, dir, &at, &ch, &val)) ...
+//	BWEvt ev[64];
+//	int n= bwfile_events(ff, beg, end, ev, 64);
+//
 //	// Check to see if more has been written to the file
 //	bwfile_check_eof(ff);
 //
+//	// Cheaply check whether the file has grown (e.g. to decide whether
+//	// it's worth updating a display following the end of a live file)
+//	if (bwfile_grown(ff)) ...
+//
+//	// Build the block index in the background (for formats that
+//	// support it), and check on it or wait for it to finish.  Until
+//	// it has finished, fetching a block past what has been indexed
+//	// so far still scans as normal.
+//	bwfile_index_start(ff);
+//	int pc= bwfile_index_progress(ff);	// -1 if done, else percentage
+//	bwfile_index_wait(ff);
+//
+//	// While the builder is running, let blocks far beyond the index be
+//	// read from an estimated position instead of scanning to them.
+//	// These have bb->approx set, and are read again from the exact
+//	// position once it is known.  bwfile_exact() says whether a block's
+//	// position is known yet, and bwfile_approx_len() estimates the
+//	// length of the file (-1 if it can't).
+//	bwfile_approx(ff, 1);
+//	if (bwfile_exact(ff, num)) ...
+//	int len= bwfile_approx_len(ff);
+//
 //	// Close the file and release resources, including any blocks 
 //	// not explicitly bwfile_free()'d
 //	bwfile_close(ff)
 //
+//	// Create a new "bwc" file, with samples stored as floats (scale 0)
+//	// or 16-bit integers (scale > 0).  This can be read from just as
+//	// above while it is being written.
+//	ff= bwfile_create(filename, rate, n_chan, scale, 1024, 4<<20);
+//
+//	// Append samples: dat[n][] for channel 'n', plus error flags
+//	// (or 0 for none).  Blocks fetched after this see the new data
+//	// without any need for bwfile_check_eof().
+//	bwfile_append(ff, dat, err, count);
+//
 //
 //	// Print a list of supported formats to 'stderr'
 //	bwfile_list_formats(stderr);
@@ -80,6 +194,12 @@
 //	    Four-channel Jim-Meissner files, 0x03 sync byte, plus 4
 //	    unsigned bytes.
 //
+//	  bwc
+//
+//	    Native files written by bwfile_transcode() (option -T),
+//	    with float32 or int16 columns in fixed-size slots.  Any
+//	    block can be read directly without scanning.
+//
 
 //
 //	Implementation:
@@ -98,42 +218,259 @@
 //	the only solution I can think of that allows a huge variety of
 //	file formats to be supported reliably and easily.
 //
+//	Where possible (regular files on Linux) the whole file is
+//	memory-mapped, and the format read routines decode straight
+//	out of the mapping.  Otherwise we fall back to stdio, reading
+//	the data for each block into a buffer first.  Either way the
+//	read routines just see a pointer to the bytes and a length.
+//	Block offsets are plain 64-bit byte offsets from the start of
+//	the file.
+//
+//	Blocks from formats with small integer samples (see ff->width)
+//	are held at that width instead of as floats, with a scaling
+//	factor.  Each block is decoded as floats into a scratch block
+//	and then packed, with a check that every value comes back
+//	exactly; if not (e.g. a NAN) that channel of the block is kept
+//	as floats.  This means a given amount of cache holds 2-4 times
+//	as much of the file.
+//
+//	Only the channels selected with bwfile_want() are decoded.
+//	The read routines are passed a null pointer for the others and
+//	skip them.  If a cached block is fetched after more channels
+//	have been asked for, the block is decoded again for just the
+//	missing channels, and these are added to it in a separate
+//	allocation chained from BWBlock.more.  Each channel's data is a
+//	separate array, as are the levels of the min/max pyramid, so
+//	files with a great many channels cost little more than the
+//	channels actually looked at.
+//
+//	Blocks are cached in a hash table keyed on block number.  Once
+//	a block is no longer referenced it goes on an LRU list, and the
+//	least recently used blocks are thrown out when the unreferenced
+//	blocks take up more than the given number of bytes.
+//
+//	A read-ahead thread watches the spans of blocks being used
+//	(see bwfile_readahead()), and decodes the next span in the
+//	direction of travel in the background.  These go into the cache
+//	as unreferenced blocks, so paging through at a steady pace
+//	finds everything already there.  Blocks whose position is
+//	already known are decoded without holding the lock, so this
+//	happens at the same time as decoding in the main thread (see
+//	file_reader.inc).
+//
+//	As full blocks are decoded, the minimum and maximum on each
+//	channel are noted in a pyramid of levels covering 1, 2, 4,
+//	... blocks (see file_pyramid.inc), so that the range of values
+//	over long spans can be found cheaply.  Runs of samples with
+//	errors are noted too (see file_errs.inc), so that errors can
+//	be found without decoding the file again, and so are changes
+//	on any switch channels (see file_events.inc).
+//
+//	Formats with fixed-size blocks of data (e.g. "bwc") provide a
+//	direct block read routine instead, and these never need
+//	scanning or a table of offsets.  This is also what makes it
+//	simple to write "bwc" files: bwfile_append() just writes the
+//	samples into their slots, updates ff->len, and drops the old
+//	last block from the cache.
+//
+//	Pipes and other streams can't be seeked in, so they are read
+//	in a background thread into a ring of the most recent blocks,
+//	and older data becomes unavailable (see file_stream.inc).
+//
+//	For regular files, the table of block offsets is saved to a
+//	sidecar file "<filename>.bwidx" when it has grown enough to be
+//	worth it, and reloaded when the file is opened again (see
+//	file_index.inc), along with the bottom level of the pyramid,
+//	the runs of errors and the switch events.
+//
 
 #ifdef HEADER
 
 typedef struct BWFile BWFile;
+typedef struct BWPyr BWPyr;
+typedef struct BWErr BWErr;
+typedef struct BWEvt BWEvt;
 typedef struct BWBlock BWBlock;
 typedef struct FormatInfo FormatInfo;
+typedef struct GzFile GzFile;
+typedef struct BWPart BWPart;
+typedef struct BWRdr BWRdr;
+
+#define BWFILE_MAX_CHAN 65536	// Sanity limit on number of channels
+#define SW_NONE 0xFF		// No switch states in this sample (see file_events.inc)
 
 struct BWFile {
-   FILE *fp;		// File pointer for reading
-   fpos_t *blk;		// Block offsets in file
+   FILE *fp;		// File pointer (used for headers, and for reading if not mapped)
+   int mapped;		// Using memory-mapped access ?  0 no (stdio), 1 yes
+   unsigned char *map;	// Memory-mapped file data, or 0 if nothing mapped yet
+   long long map_len;	// Number of bytes mapped
+   unsigned char *buf;	// Read buffer for stdio access, or 0
+   int buf_siz;		// Size of buf[] in bytes
+   GzFile *gz;		// Decompression state for a gzip-compressed file, or 0 (see file_gzip.inc)
+   BWPart *part;	// Parts of a file split into several, or 0 (see file_parts.inc)
+   int n_part;		// Number of entries in part[], or 0 for a single file
+   long long start;	// File offset of block 0 (i.e. after any header)
+   long long *blk;	// Block offsets in file
    int m_blk;		// Max blocks in blk[] (i.e. size of array)
    int n_blk;		// Number of block-offsets stored in blk[].
-   fpos_t pos;		// Position to find next block after n_blk
+   long long pos;	// Position to find next block after n_blk
    int eof;		// Hit EOF yet ?
+   char *fmt;		// Format-spec, StrDup'd
+   char *idx_fnam;	// Sidecar index filename, or 0 if not using one
+   int idx_n_blk;	// Value of n_blk when sidecar last saved/loaded
+   int idx_eof;		// Value of eof when sidecar last saved/loaded
+   int idx_pyr_n;	// Value of pyr_n when sidecar last saved/loaded
+   int ino_fd;		// inotify descriptor watching the file, or -1
+   long long chk_size;	// File size when last found to have grown, or -1 if we can't tell
+   int grown;		// File has grown, waiting for bwfile_check_eof() to pick it up
+   int writing;		// Made by bwfile_create() for bwfile_append() ?
+
+   int stream;		// Reading a pipe or other stream ?  0 no, 1 yes (see file_stream.inc)
+   BWBlock **ring;	// Last n_ring blocks read from the stream, indexed by num % n_ring
+   int n_ring;		// Size of ring[]
+   int ring_first;	// First block still in ring[]; earlier ones are gone for good
+   int st_len;		// Number of samples read from the stream so far
+   int st_part;		// Last block in ring[] is partial, and may be replaced ?
+   long long st_off;	// Stream offset of buf[0]
+   int st_have;		// Bytes of stream data in buf[]
+   SDL_Thread *st;	// Stream reader thread, or 0
+   SDL_cond *st_cond;	// Signalled (with ff->lock held) when a block goes into ring[],
+			//  or with st_through, when the caller finishes with one
+   volatile int st_quit;	// Set to ask the stream reader thread to exit
+   int st_through;	// Stream is read straight through, so wait for blocks to be used ?
+   int st_next;		// With st_through, blocks before this one have been used
+   int st_lfd;		// Listening socket for a "unix:" stream, or -1
+   char *st_path;	// Path of that socket, to remove when done, or 0
 
    int bsiz;		// Block size in samples
-   int max_unref;	// Maximum number of unreferenced blocks in cache
+   int width;		// Bytes per sample to hold cached blocks at: 4 (floats), 2 or 1
+   float scale;		// Scaling for cached blocks held at 2 or 1 bytes per sample
+   BWRdr *rd;		// Scratch space for decoding blocks in the main thread (see file_reader.inc)
+   char *want;		// Channels to decode: want[c] non-zero if wanted, or 0 for all
+   char *need;		// Scratch list of channels missing from a block
+   int n_want;		// Number of channels wanted
+   int want_gen;	// Incremented every time want[] changes
 
-   int (*read)(BWFile*,BWBlock*,FILE*,float**,char*,int);  // Format-specific read routine
+   int (*read)(BWFile*,BWBlock*,unsigned char*,int,int*,float**,char*,int);  // Format-specific read routine
+   int (*skip)(BWFile*,unsigned char*,int,int,int*,char*,unsigned char*,int);  // Format-specific skip routine, or 0
+   int (*resync)(BWFile*,unsigned char*,int);	// Format-specific resync routine, or 0
+   int (*read_blk)(BWFile*,BWBlock*,int);	// Format-specific direct block read routine, or 0
+   void (*size_blk)(BWFile*);	// Format-specific size routine for direct access, or 0
    void *read_data;	// Special format-specific data, or 0.  Released with free()
+   int stride;		// Bytes per sample, for formats where this is fixed, or 0
+   long long data_end;	// File offset where such samples stop, or 0 for the end of the file
+   int sw_chan;		// First channel holding switch states, for formats with them
+   int n_sw;		// Number of such channels, or 0 (see file_events.inc)
+   unsigned char *sw;	// Scratch switch states for one block, if n_sw set
    double rate;		// Sample rate of file
    int chan;		// Number of channels in the file
    int len;		// Length of file in samples, or -1 if end not reached yet
    
-   BWBlock *cache;	// Cached block list, or 0
-   int use;		// Use counter, used to find old blocks to delete
+   BWBlock **hash;	// Hash table of cached blocks, chained through BWBlock.nxt
+   int hash_siz;	// Size of hash[], a power of 2
+   int n_cache;		// Number of blocks in hash[]
+   BWBlock *lru_new;	// Most recently used unreferenced block, or 0
+   BWBlock *lru_old;	// Least recently used unreferenced block, or 0
+   BWBlock *dead;	// Referenced blocks dropped from the cache by bwfile_check_eof(),
+			//  or from the ring for a stream
+   int unref_siz;	// Bytes in unreferenced blocks
+   int max_unref;	// Maximum bytes in unreferenced blocks to keep
+   int c_hit;		// Count of cache hits
+   int c_miss;		// Count of cache misses
+   int c_evict;		// Count of blocks evicted from cache
+
+   BWPyr **pyr;		// Min/max pyramid for each channel, all levels (see
+			//  file_pyramid.inc), or 0 for channels with none yet
+   int pyr_m;		// Number of entries in level 0, a power of 2
+   int pyr_n;		// Number of level-0 entries filled in, all channels
+
+   BWErr *err_run;	// Runs of samples with errors, in order (see file_errs.inc)
+   int n_err_run;	// Number of entries in err_run[]
+   int m_err_run;	// Allocated size of err_run[]
+   int err_blk;		// Blocks before this one have had their errors noted
+
+   BWEvt *ev;		// Changes of switch state, in order (see file_events.inc)
+   int n_ev;		// Number of entries in ev[]
+   int m_ev;		// Allocated size of ev[]
+   int ev_blk;		// Blocks before this one have had their switch states noted
+   int ev_state;	// Switch states after the last of those blocks, bit 'a' for
+			//  channel sw_chan+a
+
+   SDL_Thread *pf;	// Read-ahead thread, or 0 if not started yet
+   SDL_cond *pf_cond;	// Signalled (with ff->lock held) when there is work or on quit
+   int pf_quit;		// Set to ask read-ahead thread to exit
+   int *pf_want;	// Block numbers to read ahead, in order
+   int pf_n, pf_i;	// Number of entries in pf_want[], and next one to do
+   int pf_m;		// Allocated size of pf_want[]
+   BWBlock *pf_done;	// Blocks read ahead, waiting to go into cache (chained through nxt)
+   int pf_last;		// First block of last span passed to bwfile_readahead(), or -1
+   BWRdr *pf_rd;	// Scratch space for decoding in the read-ahead thread
+
+   SDL_mutex *lock;	// Lock for the block index, shared with the index builder
+   int n_rd;		// Number of blocks being decoded without the lock held
+   SDL_cond *rd_cond;	// Signalled (with ff->lock held) when n_rd drops to 0
+   SDL_Thread *bld;	// Background index builder thread, or 0
+   volatile int bld_run;	// Builder still running ?
+   volatile int bld_stop;	// Set to ask the builder to stop early
+   volatile long long bld_done;	// Builder progress: bytes done
+   long long bld_total;	// Builder progress: total bytes to do
+   unsigned char *bld_map;	// Builder's own mapping of the file
+   long long bld_map_len;	// Length of builder's mapping
+   int bld_nthr;	// Number of builder worker threads
+   long long bld_pos;	// File offset builder started from
+   int bld_n_blk;	// Block number builder started from
+
+   int approx;		// Allow approximate block positions (see file_approx.inc) ?
+   int ap_num;		// Block following the last one read approximately, or -1
+   long long ap_off;	// File offset of that block
 };
 
 struct BWBlock {
-   BWBlock *nxt;	// Next in list, or 0
+   BWBlock *nxt;	// Next in hash chain (or BWFile.dead list), or 0
+   BWBlock *lru_prv;	// Next more recently used in LRU list, or 0
+   BWBlock *lru_nxt;	// Next less recently used in LRU list, or 0
    int num;		// Block number in file, counting from 0
    int ref;		// Reference count
-   int last_used;	// Set from BWFile.use when ref goes to 0
+   int siz;		// Size of block allocation in bytes
    int len;		// Number of samples in this block
-   float **chan;	// Array of float data for channels
-   char *err;		// Array of error flags for the data: 0 no error, 1 sync error
+   int gen;		// Value of BWFile.want_gen when last checked for missing channels
+   float scale;		// Multiplier to convert ch16[] and ch8[] values to floats
+   float **chan;	// Float data for each channel, or 0 if held as integers or not decoded
+   short **ch16;	// 16-bit data for each channel, or 0
+   signed char **ch8;	// 8-bit data for each channel, or 0
+   char *err;		// Error flags while decoding, one per sample (see call_read()), else 0
+   int n_err;		// Number of samples with errors, 0 for a clean block
+   unsigned char *err_bit; // Error flags, one bit per sample (see BWBLOCK_ERR()), or 0
+   BWErr *err_run;	// Runs of samples with errors, as offsets into the block, or 0
+   int n_err_run;	// Number of entries in err_run[]
+   int approx;		// Read from an estimated position (see file_approx.inc) ?
+   void *more;		// Allocation holding channels added later, or 0.  Chained 
+			//  through the first pointer in each.
+};
+
+// Get sample 'a' on channel 'c' of block 'bb' as a float
+#define BWBLOCK_VAL(bb, c, a) ((bb)->chan[c] ? (bb)->chan[c][a] : \
+   ((bb)->ch16[c] ? (bb)->ch16[c][a] : (bb)->ch8[c][a]) * (bb)->scale)
+
+// Has channel 'c' of block 'bb' been decoded ?
+#define BWBLOCK_HAS(bb, c) ((bb)->chan[c] || (bb)->ch16[c] || (bb)->ch8[c])
+
+// Does sample 'a' of block 'bb' have an error ?
+#define BWBLOCK_ERR(bb, a) ((bb)->n_err && ((bb)->err_bit[(a)>>3] >> ((a)&7) & 1))
+
+struct BWPyr {
+   float min, max;	// Range of values, not counting errors
+   int flag;		// 0 not known yet, 1 known, 2 known but has errors or NANs
+};
+
+struct BWErr {
+   int beg, end;	// Samples beg to end-1 have errors
+};
+
+struct BWEvt {
+   int pos;		// Sample number
+   short chan;		// Channel that changed
+   short val;		// New state: 0 off, 1 on
 };
 
 struct FormatInfo {
@@ -149,8 +486,111 @@ struct FormatInfo {
 //	File format specific code is separate
 //
 
+#include "file_gzip.inc"
+#include "file_parts.inc"
+
+static unsigned char *get_bytes(BWFile *ff, long long off, int len);
+static long long file_len(BWFile *ff);
 #include "file_formats.inc"
+#include "file_pyramid.inc"
+static void *block_more(BWBlock *bb, int siz);
+#include "file_errs.inc"
+#include "file_events.inc"
+#include "file_index.inc"
 
+static void set_eof(BWFile *ff, int len);
+static void grow_blk(BWFile *ff, int num);
+#include "file_build.inc"
+
+static void free_block(BWBlock *bb);
+static BWBlock *dec_block(BWFile *ff, BWRdr *rd, int num, char *need);
+static BWBlock *pack_block(BWFile *ff, BWRdr *rd, BWBlock *src, char *need, BWBlock *bb);
+#include "file_stream.inc"
+
+static int read_at(BWFile *ff, BWBlock *bb, long long off, int *usedp, int skip);
+static void scan_to(BWFile *ff, BWBlock *bb, int num);
+static void drop_block(BWFile *ff, int num);
+#include "file_approx.inc"
+
+static int call_read(BWFile *ff, BWBlock *bb, unsigned char *dat, int siz, int *usedp, 
+		     int skip, unsigned char *sw);
+static BWBlock *float_block(BWFile *ff, int num, char *need);
+static BWBlock *get_block(BWFile *ff, BWRdr *rd, int num);
+#include "file_reader.inc"
+
+static BWFile *open_file(char *fmt, char **fnams, int n_fnam, int bsiz, int max_unref, int through);
+
+
+//
+//	(Re-)map the file into memory if its size has changed since
+//	it was last mapped.  Falls back to stdio access if the mapping
+//	fails (e.g. a file too large for a 32-bit address space).
+//
+
+static void 
+map_file(BWFile *ff) {
+#ifdef T_LINUX
+   long long len= file_len(ff);
+
+   if (len == ff->map_len)
+      return;
+
+   if (ff->map) munmap(ff->map, ff->map_len);
+   ff->map= 0;
+   ff->map_len= 0;
+   if (len == 0) 
+      return;
+
+   if (!(ff->map= map_data(ff, len))) {
+      ff->mapped= 0;
+      return;
+   }
+   ff->map_len= len;
+#endif
+}
+
+//
+//	Allocate a new BWFile, set up ready for the format-specific
+//	parts
+//
+
+static BWFile *
+new_file(char *fmt, int bsiz, int max_unref) {
+   BWFile *ff= ALLOC(BWFile);
+
+   ff->bsiz= bsiz;
+   ff->width= 4;
+   ff->max_unref= max_unref;
+   ff->fmt= StrDup(fmt);
+   ff->m_blk= 256;
+   ff->blk= ALLOC_ARR(ff->m_blk, long long);
+   ff->hash_siz= 256;
+   ff->hash= ALLOC_ARR(ff->hash_siz, BWBlock*);
+   ff->pf_last= -1;
+   ff->ap_num= -1;
+   ff->len= -1;
+   ff->ino_fd= -1;
+   ff->chk_size= -1;
+   ff->st_lfd= -1;
+   ff->rd= ALLOC(BWRdr);
+   if (!(ff->lock= SDL_CreateMutex()))
+      errorSDL("Couldn't create mutex");
+   if (!(ff->rd_cond= SDL_CreateCond()))
+      errorSDL("Couldn't create condition variable");
+   return ff;
+}
+
+//
+//	Set up the per-channel arrays, once the number of channels is
+//	known
+//
+
+static void 
+new_chan(BWFile *ff) {
+   ff->n_want= ff->chan;
+   ff->need= ALLOC_ARR(ff->chan, char);
+   ff->pyr= ALLOC_ARR(ff->chan, BWPyr*);
+}
 
 //
 //	Open a file
@@ -158,11 +598,13 @@ struct FormatInfo {
 //	fmt	File format spec (see docs above for details)
 //	fnam	File name
 //	bsiz	Size to use for blocks, in samples, e.g. 1000 or 1024
-//	max_unref  Maximum number of unreferenced blocks to keep in cache
-//		    (e.g. 0 or 20)
+//	max_unref  Maximum bytes of unreferenced blocks to keep in cache
+//		    (e.g. 0 or 4<<20)
 //
 //	Memory consumption for each block when it is brought into
-//	memory is roughly 4 * channels * bsiz.  
+//	memory is roughly 4 * channels * bsiz, or less for formats with
+//	small integer samples or if only some channels are wanted (see
+//	bwfile_want()).
 //
 //	Also note that a file-position has to be stored for each block
 //	in the file (to enable random access), which is roughly 8
@@ -172,137 +614,910 @@ struct FormatInfo {
 
 BWFile *
 bwfile_open(char *fmt, char *fnam, int bsiz, int max_unref) {
-   BWFile *ff= ALLOC(BWFile);
+   return bwfile_open_parts(fmt, &fnam, 1, bsiz, max_unref);
+}
+
+//
+//	Open a file that has been split into 'n_fnam' parts, fnam[0]
+//	to fnam[n_fnam-1], as if they were all one file (see
+//	file_parts.inc).  Other arguments are as for bwfile_open().
+//
+
+BWFile *
+bwfile_open_parts(char *fmt, char **fnams, int n_fnam, int bsiz, int max_unref) {
+   return open_file(fmt, fnams, n_fnam, bsiz, max_unref, 0);
+}
+
+//
+//	Open a file as for bwfile_open_parts().  If 'through' is set
+//	and the file turns out to be a stream, it is going to be read
+//	straight through with st_get_wait(), so the reader thread
+//	waits for each block to be used rather than letting it drop
+//	out of the ring (see file_stream.inc).
+//
+
+static BWFile *
+open_file(char *fmt, char **fnams, int n_fnam, int bsiz, int max_unref, int through) {
+   BWFile *ff= new_file(fmt, bsiz, max_unref);
+   char *fnam= fnams[0];
    int a;
    char *tmp, *arg;
+   FILE *in;
 
-   ff->bsiz= bsiz;
-   ff->max_unref= max_unref;
-   
-   if (!(ff->fp= fopen(fnam, "rb")))
+   ff->st_through= through;
+
+   if (0 == strcmp(fnam, "-"))
+      ff->fp= stdin;
+   else if (0 == strncmp(fnam, "unix:", 5))
+      ff->fp= st_listen(ff, fnam + 5);
+   else if (!(ff->fp= fopen(fnam, "rb")))
       error("File not found: %s", fnam);
 
-   ff->m_blk= 256;
-   ff->blk= ALLOC_ARR(ff->m_blk, fpos_t);
-   ff->len= -1;
+   // Anything that isn't a regular file can't be seeked in, so has to
+   // be read as a stream.  Turn off buffering so that reading the
+   // header doesn't take any data that the reader thread should get.
+   {
+      struct stat st;
+      if (0 == fstat(fileno(ff->fp), &st) && !S_ISREG(st.st_mode)) {
+	 ff->stream= 1;
+	 setvbuf(ff->fp, 0, _IONBF, 0);
+      }
+   }
+
+   // A compressed file is read through a decompressing layer, and the
+   // setup routines see the decompressed data
+   if (!ff->stream) gz_open(ff);
+   in= ff->gz ? gz_stdio(ff) : ff->fp;
+
+   if (n_fnam > 1) {
+      if (ff->stream || ff->gz)
+	 error("Only uncompressed regular files can be read as parts of one file: %s", fnam);
+      part_open(ff, fnams, n_fnam);
+   }
 
    tmp= StrDup(fmt);
    arg= strchr(tmp, '/');
    if (arg) *arg++= 0; else arg= "";
    
    for (a= 0; format_list[a].setup; a++) 
-      if (format_list[a].setup(ff, ff->fp, tmp, arg))
+      if (format_list[a].setup(ff, in, tmp, arg))
 	 break;
    
    free(tmp);
 
-   if (!ff->read) 
+   if (!ff->read && !ff->read_blk) 
       error("Format-specification not recognised: %s", fmt);
    if (ff->rate <= 0) 
       error("Bad sample rate from format or file: %g", ff->rate);
-   if (ff->chan < 1 || ff->chan > 256)
+   if (ff->chan < 1 || ff->chan > BWFILE_MAX_CHAN)
       error("Bad number of channels from format or file: %d", ff->chan);
+   if (ff->width != 4 && ((ff->width != 1 && ff->width != 2) || !(ff->scale > 0)))
+      error("Internal error -- bad sample width from format: %d", ff->width);
 
-   if (0 != fgetpos(ff->fp, &ff->pos)) 
+   new_chan(ff);
+   if (ff->n_sw) ff->sw= ALLOC_ARR(ff->bsiz, unsigned char);
+
+   if (ff->stream) {
+      st_start(ff);
+      return ff;
+   }
+
+   if (0 > (ff->start= ff->pos= FTELL(in)))
       error("Unexpected error getting file position: %s", strerror(errno));
+   if (in != ff->fp) fclose(in);
+
+   // With a fixed number of bytes per sample, any block can be found
+   // directly.  (Not for a compressed file, though, because getting
+   // the size would mean decompressing it all first.)
+   if (ff->stride && !ff->gz) {
+      ff->read_blk= read_blk_fixed;
+      ff->size_blk= size_blk_fixed;
+   } else if (ff->stride && !ff->skip)
+      ff->skip= skip_fixed;
+
+   // Use mmap and a sidecar index only for regular files
+   {
+      struct stat st;
+      if (0 == fstat(fileno(ff->fp), &st) && S_ISREG(st.st_mode)) {
+#ifdef T_LINUX
+	 if (!ff->gz) {
+	    ff->mapped= 1;
+	    map_file(ff);
+	 }
+#endif
+	 // The sidecar for a file in parts is named after the first
+	 // part and the number of others
+	 if (!ff->read_blk) {
+	    ff->idx_fnam= ALLOC_ARR(strlen(fnam) + 24, char);
+	    if (n_fnam > 1)
+	       sprintf(ff->idx_fnam, "%s+%d.bwidx", fnam, n_fnam-1);
+	    else
+	       sprintf(ff->idx_fnam, "%s.bwidx", fnam);
+	    load_index(ff);
+	 }
+
+	 // Watch for the file (or its last part) growing
+	 ff->chk_size= ff->n_part ? part_size(ff, 0) : st.st_size;
+#ifdef T_LINUX
+	 if (0 <= (ff->ino_fd= inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) &&
+	     0 > inotify_add_watch(ff->ino_fd, fnams[n_fnam-1], IN_MODIFY)) {
+	    close(ff->ino_fd);
+	    ff->ino_fd= -1;
+	 }
+#endif
+      }
+   }
+
+   // Direct access formats know their size right away
+   if (ff->read_blk) {
+      ff->size_blk(ff);
+      ff->n_blk= ff->len / ff->bsiz + 1;
+      ff->eof= 1;
+   }
+
+   return ff;
+}
+
+//
+//	Create a new "bwc" file (see file_formats.inc) to write to
+//	with bwfile_append().  The BWFile returned can be read from at
+//	the same time, just like one from bwfile_open(), and samples
+//	appended show up in it straight away.
+//
+//	fnam	File name
+//	rate	Sample rate
+//	chan	Number of channels
+//	scale	0 to store the samples as floats, or else the scaling
+//		 to store them as 16-bit integers, e.g. 1.0/32768
+//	bsiz	Block size, as for bwfile_open().  This is also the
+//		 number of samples per slot in the file.
+//	max_unref  As for bwfile_open()
+//
+
+BWFile *
+bwfile_create(char *fnam, double rate, int chan, float scale, int bsiz, int max_unref) {
+   BWFile *ff= new_file("bwc", bsiz, max_unref);
+   BwcInfo *bi;
+   unsigned char hdr[BWC_HSIZ];
+
+   if (chan < 1 || chan > BWFILE_MAX_CHAN || (long long)chan * bsiz > INT_MAX / 8)
+      error("Bad number of channels for new file: %d", chan);
+   if (!(ff->fp= fopen(fnam, "w+b")))
+      error("Can't create file: %s", fnam);
+
+   bi= (BwcInfo *)Alloc(sizeof(BwcInfo) + (bsiz + 7) / 8);
+   bi->werr= (unsigned char *)(bi + 1);
+   bi->bsiz= bsiz;
+   bi->typ= scale > 0;
+   bi->scale= bi->typ ? scale : 1.0;
+   bi->slot= BWC_SLOT(chan, bsiz, bi->typ);
+   if (bi->typ) {
+      ff->width= 2;
+      ff->scale= scale;
+   }
+   ff->read_data= bi;
+   ff->read_blk= read_blk_bwc;
+   ff->size_blk= size_blk_bwc;
+   ff->rate= rate;
+   ff->chan= chan;
+   new_chan(ff);
+
+   memset(hdr, 0, sizeof(hdr));
+   memcpy(hdr, BWC_MAGIC, 8);
+   memcpy(hdr + 8, &rate, sizeof(double));
+   memcpy(hdr + 16, &chan, sizeof(int));
+   memcpy(hdr + 20, &bsiz, sizeof(int));
+   memcpy(hdr + 24, &bi->typ, sizeof(int));
+   memcpy(hdr + 28, &bi->scale, sizeof(float));
+   put_bwc(ff, 0, hdr, BWC_HSIZ);
 
+   ff->writing= 1;
+   ff->start= BWC_HSIZ;
+   ff->len= 0;
+   ff->n_blk= 1;
+   ff->eof= 1;
    return ff;
 }
 
 //
-//	Read a block of data from the file (ignores cache).
+//	Read up to 'len' bytes at file offset 'off' into 'buf' using
+//	stdio, or from the decompressed data for a compressed file, or
+//	across the parts of a file in several parts.
+//	Returns the number of bytes read, which is less than 'len' only
+//	at the end of the file.
+//
+
+static int
+read_file(BWFile *ff, long long off, unsigned char *buf, int len) {
+   int got;
+
+   if (ff->gz) return gz_read(ff, off, buf, len);
+   if (ff->n_part) return part_read(ff, off, buf, len);
+
+   if (0 != FSEEK(ff->fp, off))
+      error("Unexpected error setting file position: %s", strerror(errno));
+   got= fread(buf, 1, len, ff->fp);
+   if (got < len && ferror(ff->fp))
+      error("Unexpected error reading file: %s", strerror(errno));
+   clearerr(ff->fp);
+   return got;
+}
+
+//
+//	Call the format read routine to read a block starting at the
+//	given file offset into 'bb'.  Returns the number of samples
+//	read, and sets *usedp to the number of bytes used.  If fewer
+//	than ff->bsiz samples are returned, then the end of the file
+//	has been reached.
+//
+//	If 'skip' is set and the format has a skip routine, that is
+//	called instead, so that only bb->err[] is filled in.  This is
+//	much faster for scanning through the file to find where the
+//	blocks are.  Any switch states go into sw[].
+//
+//	The read routines flag errors with one char per sample in
+//	bb->err[], which only exists while decoding.  err_pack() puts
+//	them into the more compact form kept in cached blocks.
+//
+//	With memory-mapped access the read routine is given the whole
+//	of the rest of the file.  With stdio access we have to guess
+//	how much data the block will need, and read more and try again
+//	if the guess was too small.
+//
+
+static int
+call_read(BWFile *ff, BWBlock *bb, unsigned char *dat, int siz, int *usedp, 
+	  int skip, unsigned char *sw) {
+   if (skip && ff->skip)
+      return ff->skip(ff, dat, siz, siz, usedp, bb->err, sw, ff->bsiz);
+   return ff->read(ff, bb, dat, siz, usedp, bb->chan, bb->err, ff->bsiz);
+}
+
+static int 
+read_at(BWFile *ff, BWBlock *bb, long long off, int *usedp, int skip) {
+   int siz, got, len;
+
+   if (ff->mapped) {
+      long long rem= ff->map_len - off;
+      if (rem <= 0) { *usedp= 0; return 0; }
+      if (rem > INT_MAX) rem= INT_MAX;
+      return call_read(ff, bb, ff->map + off, (int)rem, usedp, skip, ff->sw);
+   }
+
+   if (!ff->buf) {
+      ff->buf_siz= 65536;
+      ff->buf= ALLOC_ARR(ff->buf_siz, unsigned char);
+   }
+
+   while (1) {
+      siz= ff->buf_siz;
+      got= read_file(ff, off, ff->buf, siz);
+      len= call_read(ff, bb, ff->buf, got, usedp, skip, ff->sw);
+      if (len == ff->bsiz || got < siz)
+	 return len;
+
+      // Not enough data in the buffer for a whole block, so try again
+      // with a bigger buffer
+      free(ff->buf);
+      ff->buf_siz *= 2;
+      ff->buf= ALLOC_ARR(ff->buf_siz, unsigned char);
+      memset(bb->err, 0, ff->bsiz * sizeof(char));
+   }
+}
+
+//
+//	Get a pointer to 'len' bytes of the file at offset 'off', for
+//	formats with direct block access.  The data stays valid until
+//	the next call.  Returns 0 if the file doesn't have that much
+//	data.
+//
+
+static unsigned char *
+get_bytes(BWFile *ff, long long off, int len) {
+   if (ff->stream)
+      return st_bytes(ff, off, len);
+   if (ff->mapped)
+      return (off + len <= ff->map_len) ? ff->map + off : 0;
+
+   if (len > ff->buf_siz) {
+      if (ff->buf) free(ff->buf);
+      ff->buf_siz= len;
+      ff->buf= ALLOC_ARR(ff->buf_siz, unsigned char);
+   }
+   if (len != read_file(ff, off, ff->buf, len))
+      return 0;
+   return ff->buf;
+}
+
+//
+//	Get the length of the file in bytes.  For a compressed file
+//	this is the decompressed length, which means decompressing it
+//	all the first time.  For a file in several parts, it is the
+//	total length.
+//
+
+static long long
+file_len(BWFile *ff) {
+   struct stat st;
+
+   if (ff->gz) return gz_len(ff);
+   if (ff->n_part) return part_size(ff, 0);
+   if (0 != fstat(fileno(ff->fp), &st))
+      error("Unexpected error checking file size: %s", strerror(errno));
+   return st.st_size;
+}
+
+//
+//	Note that we've reached the end of the file.  'len' is the
+//	length of the final block.  The sidecar index is saved if it
+//	has grown significantly since it was last saved.
+//
+
+static void 
+set_eof(BWFile *ff, int len) {
+   ff->eof= 1; 
+   ff->len= (ff->n_blk-1)*ff->bsiz + len; 
+   if (ff->n_blk > ff->idx_n_blk + ff->idx_n_blk/8)
+      save_index(ff);
+}
+
+//
+//	Make sure there is room in ff->blk[] for block 'num' and the
+//	one after it.  All the old entries are kept, not just those up
+//	to ff->n_blk, because the builder fills in a whole window of
+//	them before updating ff->n_blk.
+//
+
+static void 
+grow_blk(BWFile *ff, int num) {
+   long long *blk;
+   int siz;
+
+   if (num + 2 <= ff->m_blk) return;
+
+   siz= ff->m_blk * 2;
+   while (siz < num+2) siz *= 2;
+      
+   blk= ALLOC_ARR(siz, long long);
+   memcpy(blk, ff->blk, ff->m_blk * sizeof(long long));
+   free(ff->blk);
+   ff->blk= blk;
+   ff->m_blk= siz;
+}
+
 //
-//	Returns 0 if the block does not exist (e.g. beyond end of
-//	file).  Also handles scanning forwards through file if
-//	necessary.  All of the data associated with a block is
-//	allocated with it so that it can all be freed at once.
+//	Allocate a block with room for the channel pointers, plus
+//	'dsiz' bytes of channel data, a pointer to which is returned in
+//	*datap.  All of the data associated with a block is allocated
+//	with it so that it can all be freed at once, apart from
+//	channels added later by fill_block() and the error flags of a
+//	block that has errors (see err_pack()).
 //
 
 static BWBlock *
-get_block(BWFile *ff, int num) {
-   int a;
-   FILE *fp= ff->fp;
-
-   // Allocate BWBlock data all together in one chunk
-   int len1= sizeof(BWBlock);
-   int len2= len1 + ff->chan * sizeof(float*);
-   int len3= len2 + ff->chan * ff->bsiz * sizeof(float);
-   int len4= len3 + ff->bsiz * sizeof(char);
-   char *cp= (char *)Alloc(len4);
+alloc_block(BWFile *ff, int num, int dsiz, char **datap) {
+   int len1= (sizeof(BWBlock) + 3 * ff->chan * sizeof(void*) + 15) & ~15;
+   int len2= len1 + dsiz;
+   char *cp= (char *)Alloc(len2);
    BWBlock *bb= (BWBlock *)cp;
-   bb->chan= (float**)(cp + len1);
-   cp += len2;
-   for (a= 0; a<ff->chan; a++) {
-      bb->chan[a]= (float *)cp;
+
+   bb->chan= (float **)(bb + 1);
+   bb->ch16= (short **)(bb->chan + ff->chan);
+   bb->ch8= (signed char **)(bb->ch16 + ff->chan);
+   bb->scale= ff->scale;
+   bb->num= num;
+   bb->siz= len2;
+   *datap= cp + len1;
+   return bb;
+}
+
+//
+//	Allocate another 'siz' bytes belonging to block 'bb', which are
+//	freed along with it
+//
+
+static void *
+block_more(BWBlock *bb, int siz) {
+   void **vpp= (void **)Alloc(16 + siz);
+   *vpp= bb->more;
+   bb->more= vpp;
+   bb->siz += 16 + siz;
+   return (char *)vpp + 16;
+}
+
+//
+//	Release a block, including any channels added to it later
+//
+
+static void 
+free_block(BWBlock *bb) {
+   while (bb->more) {
+      void *vp= bb->more;
+      bb->more= *(void **)vp;
+      free(vp);
+   }
+   free(bb);
+}
+
+//
+//	Allocate a block with float arrays of ff->bsiz samples for the
+//	channels in need[], or all channels if 'need' is 0
+//
+
+static BWBlock *
+float_block(BWFile *ff, int num, char *need) {
+   BWBlock *bb;
+   char *cp;
+   int c, n= 0;
+
+   for (c= 0; c<ff->chan; c++) 
+      if (!need || need[c]) n++;
+   bb= alloc_block(ff, num, n * ff->bsiz * sizeof(float), &cp);
+   for (c= 0; c<ff->chan; c++) {
+      if (need && !need[c]) continue;
+      bb->chan[c]= (float *)cp;
       cp += ff->bsiz * sizeof(float);
    }
-   bb->err= cp;
+   return bb;
+}
+
+//
+//	Set up the scratch float block rd->dec, ready to decode block
+//	'num' into, with just the channels in need[] (or all if 'need'
+//	is 0)
+//
+
+static BWBlock *
+dec_block(BWFile *ff, BWRdr *rd, int num, char *need) {
+   BWBlock *bb;
+   int c;
+
+   if (!rd->dec) {
+      rd->dec= float_block(ff, -1, 0);
+      rd->dec_dat= ALLOC_ARR(ff->chan, float*);
+      memcpy(rd->dec_dat, rd->dec->chan, ff->chan * sizeof(float*));
+      rd->pk_w= ALLOC_ARR(ff->chan, char);
+      if (ff->width < 4) 
+	 rd->pk= ALLOC_ARR(ff->chan * ff->bsiz * ff->width, char);
+   }
+   bb= rd->dec;
+   for (c= 0; c<ff->chan; c++)
+      bb->chan[c]= (!need || need[c]) ? rd->dec_dat[c] : 0;
+   bb->err= rdr_err(ff, rd);
    bb->num= num;
+   return bb;
+}
+
+#ifdef __SSE2__
+
+//
+//	Check that the 8 16-bit values in 's' times 'scale' give
+//	exactly the floats at 'in'
+//
+
+static int 
+vpack_ok(__m128i s, float *in, __m128 scale) {
+   __m128 f0= _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+   __m128 f1= _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+   __m128 eq= _mm_and_ps(_mm_cmpeq_ps(_mm_mul_ps(f0, scale), _mm_loadu_ps(in)),
+			 _mm_cmpeq_ps(_mm_mul_ps(f1, scale), _mm_loadu_ps(in + 4)));
+   return _mm_movemask_ps(eq) == 15;
+}
+
+//
+//	Convert 8 floats at 'in' to 16-bit values, saturating
+//
+
+static __m128i 
+vpack_16(float *in, __m128 mul) {
+   return _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in), mul)),
+			  _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + 4), mul)));
+}
+
+#endif
+
+//
+//	Pack 'len' floats into integers of 'width' bytes such that each
+//	integer times 'scale' gives back exactly the same float.
+//	Returns 0 if that isn't possible.
+//
+
+static int 
+pack_chan(float *in, void *out, int len, int width, float scale) {
+   int lim= (width == 2) ? 32767 : 127;
+   float mul= 1 / scale;
+   int a= 0;
+#ifdef __SSE2__
+   __m128 vmul= _mm_set1_ps(mul);
+   __m128 vscale= _mm_set1_ps(scale);
+
+   if (width == 2) {
+      for (; a + 8 <= len; a += 8) {
+	 __m128i s= vpack_16(in + a, vmul);
+	 if (!vpack_ok(s, in + a, vscale)) return 0;
+	 _mm_storeu_si128((__m128i *)((short *)out + a), s);
+      }
+   } else {
+      for (; a + 16 <= len; a += 16) {
+	 __m128i b= _mm_packs_epi16(vpack_16(in + a, vmul), vpack_16(in + a + 8, vmul));
+	 if (!vpack_ok(_mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8), in + a, vscale) ||
+	     !vpack_ok(_mm_srai_epi16(_mm_unpackhi_epi8(b, b), 8), in + a + 8, vscale))
+	    return 0;
+	 _mm_storeu_si128((__m128i *)((signed char *)out + a), b);
+      }
+   }
+#endif
+   for (; a<len; a++) {
+      float val= in[a] * mul;
+      int iv;
+      if (!(val >= -lim-1 && val <= lim)) return 0;	// Also catches NANs
+      iv= (int)floor(val + 0.5);
+      if (iv * scale != in[a]) return 0;
+      if (width == 2) ((short *)out)[a]= iv;
+      else ((signed char *)out)[a]= iv;
+   }
+   return 1;
+}
+
+//
+//	Copy the channels in need[] (or all if 'need' is 0) from float
+//	block 'src', each held at ff->width bytes per sample if
+//	possible, or else as floats, using the scratch space in 'rd'.
+//	If 'bb' is 0 they go into a new block, which is returned.
+//	Otherwise they are added to 'bb' in a separate allocation.
+//
+
+static BWBlock *
+pack_block(BWFile *ff, BWRdr *rd, BWBlock *src, char *need, BWBlock *bb) {
+   int len= bb ? bb->len : src->len;
+   int width= ff->width;
+   int c, dsiz= 0;
+   char *cp;
+
+   // Pack them first, to find out how much room they need
+   for (c= 0; c<ff->chan; c++) {
+      int cw= 0;
+      if (!need || need[c]) {
+	 cw= (width < 4 && pack_chan(src->chan[c], rd->pk + c * ff->bsiz * width,
+				     len, width, ff->scale)) ? width : 4;
+	 dsiz += (len * cw + 7) & ~7;
+      }
+      rd->pk_w[c]= cw;
+   }
+
+   if (!bb) {
+      bb= alloc_block(ff, src->num, dsiz, &cp);
+      bb->len= len;
+      err_pack(bb, src->err);
+   } else 
+      cp= (char *)block_more(bb, dsiz);
+
+   for (c= 0; c<ff->chan; c++) {
+      int cw= rd->pk_w[c];
+      if (!cw) continue;
+      if (cw == 4) {
+	 memcpy(cp, src->chan[c], len * sizeof(float));
+	 bb->chan[c]= (float *)cp;
+      } else {
+	 memcpy(cp, rd->pk + c * ff->bsiz * width, len * cw);
+	 if (cw == 2) bb->ch16[c]= (short *)cp;
+	 else bb->ch8[c]= (signed char *)cp;
+      }
+      cp += (len * cw + 7) & ~7;
+   }
+   return bb;
+}
+
+//
+//	Scan forward from the last block found so far, noting the
+//	file-position of each block, until the file-position of block
+//	'num' is known or the end of the file is reached.  Where the
+//	format has a skip routine nothing is decoded, else blocks are
+//	read into 'bb'.  Leaves bb->err[] messed up.  Must be called
+//	with ff->lock held.
+//
+
+static void
+scan_to(BWFile *ff, BWBlock *bb, int num) {
+   int len, used;
+
+   while (num > ff->n_blk && !ff->eof) {
+      grow_blk(ff, ff->n_blk);
+      memset(bb->err, 0, ff->bsiz * sizeof(char));
+      ff->blk[ff->n_blk++]= ff->pos;
+      len= read_at(ff, bb, ff->pos, &used, 1);
+      ff->pos += used;
+      err_note(ff, ff->n_blk-1, bb->err, len);
+      ev_note(ff, ff->n_blk-1, ff->sw, len);
+      if (len < ff->bsiz) 
+	 set_eof(ff, len);
+   }
+}
+
+//
+//	Note the switch states in block 'num', at file offset 'off',
+//	if this is the next block the event index needs.  The read
+//	routines don't give these, so the block is skipped over first
+//	to get them.  Leaves bb->err[] zeroed.  Must be called with
+//	ff->lock held.
+//
+
+static void
+ev_fill(BWFile *ff, BWBlock *bb, int num, long long off) {
+   int len, used;
+
+   if (!ff->n_sw || num != ff->ev_blk) return;
+   len= read_at(ff, bb, off, &used, 1);
+   ev_note(ff, num, ff->sw, len);
+   memset(bb->err, 0, ff->bsiz * sizeof(char));
+}
+
+//
+//	Decode block 'num' from the file into 'bb', which must be a
+//	float block with bb->err[] zeroed.  Only the channels with
+//	arrays in bb->chan[] are decoded.  Returns 0 if the block
+//	does not exist (e.g. beyond end of file).  Also handles
+//	scanning forwards through file if necessary.
+//
+
+static int 
+decode_block(BWFile *ff, BWBlock *bb, int num) {
+   int used, rv;
 
    // Sanity check
-   if (num < 0) { free(bb); return 0; }
+   if (num < 0) return 0;
+   bb->approx= 0;
+
+   // Direct access formats don't need any scanning
+   if (ff->read_blk) {
+      if (num >= ff->n_blk) return 0;
+      bb->len= ff->read_blk(ff, bb, num);
+      err_note(ff, num, bb->err, bb->len);
+      return 1;
+   }
 
    // Do a simple re-read if this has already been read once
    if (num < ff->n_blk) {
-      if (0 != fsetpos(fp, &ff->blk[num]))
-	 error("Unexpected error setting file position: %s", strerror(errno));
-      bb->len= ff->read(ff, bb, fp, bb->chan, bb->err, ff->bsiz);
+      ev_fill(ff, bb, num, ff->blk[num]);
+      bb->len= read_at(ff, bb, ff->blk[num], &used, 0);
+      err_note(ff, num, bb->err, bb->len);
 
       // No need to save file-position, because it has already been done
-      return bb;
+      return 1;
    }
 
+   // Far beyond the index, maybe just estimate where the block is
+   if ((rv= approx_block(ff, bb, num)))
+      return rv > 0;
+
    // Reallocate the ff->blk array if it isn't big enough
-   if (num + 2 > ff->m_blk) {
-      fpos_t *blk;
-      int siz= ff->m_blk * 2;
-      while (siz < num+2) siz *= 2;
-      
-      blk= ALLOC_ARR(siz, fpos_t);
-      memcpy(blk, ff->blk, ff->n_blk * sizeof(fpos_t));
-      free(ff->blk);
-      ff->blk= blk;
-   }
+   grow_blk(ff, num);
 
    // Skip over as many blocks as necessary to find the file-position
    // for this block
-   if (0 != fsetpos(fp, &ff->pos))
-      error("Unexpected error setting file position: %s", strerror(errno));
-
-   if (num > ff->n_blk && !ff->eof) {
-      while (num > ff->n_blk) {
-	 int len;
-	 memcpy(&ff->blk[ff->n_blk++], &ff->pos, sizeof(fpos_t));
-	 len= ff->read(ff, bb, fp, bb->chan, bb->err, ff->bsiz);
-	 if (feof(fp)) { 
-	    ff->eof= 1; 
-	    ff->len= (ff->n_blk-1)*ff->bsiz + len; 
-	    break;
-	 }
-	 if (0 != fgetpos(ff->fp, &ff->pos))
-	    error("Unexpected error getting file position: %s", strerror(errno));
-      }
-   }
+   scan_to(ff, bb, num);
 
    // Off end of file
-   if (ff->eof) { free(bb); return 0; }
+   if (ff->eof) return 0;
 
    // Clear bb->err[], which we might have messed up in our scan above
    memset(bb->err, 0, ff->bsiz * sizeof(char));
 
    // Read the block in
-   memcpy(&ff->blk[ff->n_blk++], &ff->pos, sizeof(fpos_t));
-   bb->len= ff->read(ff, bb, fp, bb->chan, bb->err, ff->bsiz);
+   ff->blk[ff->n_blk++]= ff->pos;
+   ev_fill(ff, bb, ff->n_blk-1, ff->pos);
+   bb->len= read_at(ff, bb, ff->pos, &used, 0);
+   ff->pos += used;
+   err_note(ff, ff->n_blk-1, bb->err, bb->len);
  
-   if (feof(fp)) {
-      ff->eof= 1;
-      ff->len= (ff->n_blk-1)*ff->bsiz + bb->len;
-   } else if (0 != fgetpos(ff->fp, &ff->pos))
-      error("Unexpected error getting file position: %s", strerror(errno));
+   if (bb->len < ff->bsiz) 
+      set_eof(ff, bb->len);
+
+   return 1;
+}
+
+//
+//	Read a block of data from the file (ignores cache), decoding
+//	just the channels in ff->want[], using the scratch space in
+//	'rd'.  Returns 0 if the block does not exist.  Must be called
+//	with ff->lock held, but if the position of the block is already
+//	known, the lock is let go while it is decoded (see
+//	file_reader.inc).
+//
+
+static BWBlock *
+get_block(BWFile *ff, BWRdr *rd, int num) {
+   BWBlock *bb;
+
+   if (rdr_ok(ff, num))
+      return rdr_block(ff, rd, num);
 
+   if (ff->width == 4) {
+      bb= float_block(ff, num, ff->want);
+      bb->err= rdr_err(ff, rd);
+      if (!decode_block(ff, bb, num)) {
+	 free_block(bb);
+	 return 0;
+      }
+      err_pack(bb, bb->err);
+   } else {
+      // Decode as floats, then pack into a block of the native width
+      BWBlock *dec= dec_block(ff, rd, num, ff->want);
+      if (!decode_block(ff, dec, num)) return 0;
+      bb= pack_block(ff, rd, dec, ff->want, 0);
+      bb->approx= dec->approx;
+   }
+   bb->gen= ff->want_gen;
    return bb;
 }
 
+//
+//	Decode any channels now wanted that are missing from cached
+//	block 'bb', and add them to it
+//
+
+static void 
+fill_block(BWFile *ff, BWBlock *bb) {
+   BWBlock *src;
+   int c, n= 0;
+
+   SDL_LockMutex(ff->lock);
+   bb->gen= ff->want_gen;
+   for (c= 0; c<ff->chan; c++) 
+      n += (ff->need[c]= (!ff->want || ff->want[c]) && !BWBLOCK_HAS(bb, c));
+
+   if (n) {
+      src= dec_block(ff, ff->rd, bb->num, ff->need);
+      if (!decode_block(ff, src, bb->num)) src->len= 0;
+
+      // This shouldn't happen, but don't leave garbage if the file
+      // has somehow changed underneath us
+      if (src->len < bb->len) 
+	 for (c= 0; c<ff->chan; c++) 
+	    if (ff->need[c])
+	       memset(src->chan[c] + src->len, 0, (bb->len - src->len) * sizeof(float));
+
+      pack_block(ff, ff->rd, src, ff->need, bb);
+      pyr_add(ff, bb);
+   }
+   SDL_UnlockMutex(ff->lock);
+}
+
+//
+//	Find a block in the hash table, returning a pointer to the
+//	pointer to it, or to the null at the end of the chain.
+//
+
+static BWBlock **
+hash_find(BWFile *ff, int num) {
+   BWBlock **prvp= &ff->hash[num & (ff->hash_siz-1)];
+   while (*prvp && (*prvp)->num != num)
+      prvp= &(*prvp)->nxt;
+   return prvp;
+}
+
+//
+//	Add a block to the hash table, growing the table if it is
+//	getting too full.
+//
+
+static void 
+hash_add(BWFile *ff, BWBlock *bb) {
+   BWBlock **prvp;
+   
+   if (ff->n_cache >= ff->hash_siz) {
+      BWBlock **old= ff->hash;
+      int a, old_siz= ff->hash_siz;
+      ff->hash_siz *= 2;
+      ff->hash= ALLOC_ARR(ff->hash_siz, BWBlock*);
+      for (a= 0; a<old_siz; a++) {
+	 while (old[a]) {
+	    BWBlock *tmp= old[a];
+	    old[a]= tmp->nxt;
+	    prvp= &ff->hash[tmp->num & (ff->hash_siz-1)];
+	    tmp->nxt= *prvp;
+	    *prvp= tmp;
+	 }
+      }
+      free(old);
+   }
+
+   prvp= &ff->hash[bb->num & (ff->hash_siz-1)];
+   bb->nxt= *prvp;
+   *prvp= bb;
+   ff->n_cache++;
+}
+
+//
+//	Unlink an unreferenced block from the LRU list
+//
+
+static void 
+lru_unlink(BWFile *ff, BWBlock *bb) {
+   if (bb->lru_prv) bb->lru_prv->lru_nxt= bb->lru_nxt;
+   else ff->lru_new= bb->lru_nxt;
+   if (bb->lru_nxt) bb->lru_nxt->lru_prv= bb->lru_prv;
+   else ff->lru_old= bb->lru_prv;
+   bb->lru_prv= bb->lru_nxt= 0;
+   ff->unref_siz -= bb->siz;
+}
+
+//
+//	Put an unreferenced block at the recently-used end of the LRU
+//	list, and throw out the oldest blocks while we have too many.
+//
+
+static void 
+lru_add(BWFile *ff, BWBlock *bb) {
+   BWBlock **prvp;
+
+   bb->lru_prv= 0;
+   bb->lru_nxt= ff->lru_new;
+   if (ff->lru_new) ff->lru_new->lru_prv= bb;
+   else ff->lru_old= bb;
+   ff->lru_new= bb;
+   ff->unref_siz += bb->siz;
+
+   while (ff->unref_siz > ff->max_unref) {
+      bb= ff->lru_old;
+      lru_unlink(ff, bb);
+      prvp= hash_find(ff, bb->num);
+      *prvp= bb->nxt;
+      ff->n_cache--;
+      ff->c_evict++;
+      free_block(bb);
+   }
+}
+
+//
+//	Read-ahead thread main routine.  Works through ff->pf_want[],
+//	leaving the blocks on ff->pf_done for the main thread to pick
+//	up.
+//
+
+static int 
+pf_main(void *vp) {
+   BWFile *ff= (BWFile *)vp;
+   BWBlock *bb;
+
+   SDL_LockMutex(ff->lock);
+   while (1) {
+      while (!ff->pf_quit && ff->pf_i >= ff->pf_n)
+	 SDL_CondWait(ff->pf_cond, ff->lock);
+      if (ff->pf_quit) break;
+
+      if (!(bb= get_block(ff, ff->pf_rd, ff->pf_want[ff->pf_i++]))) {
+	 ff->pf_i= ff->pf_n;	// Off the end of the file
+	 continue;
+      }
+      pyr_add(ff, bb);
+      bb->nxt= ff->pf_done;
+      ff->pf_done= bb;
+   }
+   SDL_UnlockMutex(ff->lock);
+   return 0;
+}
+
+//
+//	Move any blocks the read-ahead thread has finished into the
+//	cache.  Call with ff->lock held.
+//
+
+static void 
+pf_collect(BWFile *ff) {
+   BWBlock *bb;
+
+   while ((bb= ff->pf_done)) {
+      ff->pf_done= bb->nxt;
+      if (*hash_find(ff, bb->num)) {
+	 free_block(bb);	// Main thread read it in the meantime
+	 continue;
+      }
+      hash_add(ff, bb);
+      lru_add(ff, bb);
+   }
+}
+
 //
 //	Get a block from the file (using cache if possible)
 //
@@ -311,68 +1526,190 @@ BWBlock *
 bwfile_get(BWFile *ff, int num) {
    BWBlock *bb;
 
-   // Scan to see if we have it in cache
-   for (bb= ff->cache; bb; bb= bb->nxt) {
-      if (bb->num == num) {
+   if (ff->stream) return st_get(ff, num);
+
+   // See if we have it in cache.  A block read from an approximate
+   // position is dropped once it can be read from the exact one.
+   if (num >= 0 && (bb= *hash_find(ff, num)) && bb->approx) {
+      int stale;
+      SDL_LockMutex(ff->lock);
+      stale= approx_stale(ff, bb);
+      SDL_UnlockMutex(ff->lock);
+      if (stale) {
+	 drop_block(ff, num);
+	 bb= 0;
+      }
+   }
+   if (num >= 0 && bb) {
+      if (bb->ref == 0) lru_unlink(ff, bb);
+      bb->ref++;
+      ff->c_hit++;
+      if (bb->gen != ff->want_gen) fill_block(ff, bb);
+      return bb;
+   }
+   
+   // Maybe the read-ahead thread has it ready
+   SDL_LockMutex(ff->lock);
+   if (ff->pf_done) {
+      pf_collect(ff);
+      if (num >= 0 && (bb= *hash_find(ff, num)) && bb->approx && approx_stale(ff, bb)) {
+	 drop_block(ff, num);
+	 bb= 0;
+      }
+      if (num >= 0 && bb) {
+	 SDL_UnlockMutex(ff->lock);
+	 lru_unlink(ff, bb);
 	 bb->ref++;
+	 ff->c_hit++;
+	 if (bb->gen != ff->want_gen) fill_block(ff, bb);
 	 return bb;
       }
    }
-   
+
    // Fetch it from disk, then
-   bb= get_block(ff, num);
+   ff->c_miss++;
+   bb= get_block(ff, ff->rd, num);
+   if (bb) pyr_add(ff, bb);
+   SDL_UnlockMutex(ff->lock);
    if (!bb) return 0;
 
    // Save it in the cache
-   bb->nxt= ff->cache;
-   ff->cache= bb;
+   hash_add(ff, bb);
 
    bb->ref++;
    return bb;
 }
 
 //
-//	Release a block no longer needed
+//	Release a block obtained with bwfile_get().  Once nothing
+//	refers to it, it goes on the LRU list, and the least recently
+//	used blocks are thrown out if there are too many.
 //
 
 void 
 bwfile_free(BWFile *ff, BWBlock *bb) {
-   bb->ref--;
-   
-   if (bb->ref == 0) {
-      BWBlock **old_prvp= 0;
-      BWBlock **prvp;
-      int old_age= 0;
-      int cnt= 0;
-
-      bb->last_used= ff->use++;
-
-      // Scan through all cached blocks to see how many unreferenced
-      // ones we have, and to delete the oldest if there are too many.
-      // It would be more efficient to keep a count of the number of
-      // unreferenced blocks, but that would be more fragile to any
-      // later changes to the code.  Scanning a short chain of
-      // structures is not too big an overhead.
-
-      for (prvp= &ff->cache; bb= *prvp; prvp= &bb->nxt) {
-	 bb= *prvp;
-	 if (bb->ref == 0) {
-	    cnt++;
-	    if (!old_prvp ||
-		ff->use - bb->last_used > old_age) {
-	       old_prvp= prvp;
-	       old_age= ff->use - bb->last_used;
-	    }
-	 }
-      }
+   BWBlock **prvp;
 
-      // Zap the oldest if we have too many
-      if (cnt > ff->max_unref) {
-	 bb= *old_prvp;
-	 *old_prvp= bb->nxt;
-	 free(bb);
-      }
+   if (ff->stream) {
+      st_free(ff, bb);
+      return;
+   }
+   if (--bb->ref > 0) return;
+
+   // Blocks dropped by bwfile_check_eof() can go straight away
+   if (bb->num < 0) {
+      for (prvp= &ff->dead; *prvp != bb; prvp= &(*prvp)->nxt) ;
+      *prvp= bb->nxt;
+      free_block(bb);
+      return;
    }
+
+   lru_add(ff, bb);
+}
+
+//
+//	Select the channels to decode into blocks from now on.  'want'
+//	has ff->chan entries, non-zero for each channel wanted, or may
+//	be 0 to decode all channels.  Blocks already decoded keep the
+//	channels they have, and get any missing ones that are now
+//	wanted filled in when they are next fetched with bwfile_get().
+//
+
+void 
+bwfile_want(BWFile *ff, char *want) {
+   int c, n= 0;
+
+   if (want) 
+      for (c= 0; c<ff->chan; c++) 
+	 if (want[c]) n++;
+   if (!want || n == ff->chan) {
+      if (!ff->want) return;
+   } else if (ff->want) {
+      for (c= 0; c<ff->chan; c++) 
+	 if (!want[c] != !ff->want[c]) break;
+      if (c == ff->chan) return;
+   }
+
+   SDL_LockMutex(ff->lock);
+   if (!want || n == ff->chan) {
+      free(ff->want);
+      ff->want= 0;
+      n= ff->chan;
+   } else {
+      if (!ff->want) ff->want= ALLOC_ARR(ff->chan, char);
+      for (c= 0; c<ff->chan; c++) 
+	 ff->want[c]= want[c] != 0;
+   }
+   ff->n_want= n;
+   ff->want_gen++;
+   SDL_UnlockMutex(ff->lock);
+}
+
+//
+//	Note that blocks 'num0' to 'num1-1' are the ones now in use for
+//	display.  Comparing with the previous call gives the direction
+//	of travel, and the same number of blocks again in that
+//	direction are read ahead in the background, as far as the cache
+//	size allows.
+//
+
+void 
+bwfile_readahead(BWFile *ff, int num0, int num1) {
+   int a, n, cnt, dir;
+   int bsiz= sizeof(BWBlock) + 3 * ff->chan * sizeof(void*) + 
+      ff->n_want * ff->bsiz * ff->width;
+
+   if (ff->stream || num0 == ff->pf_last) return;
+   dir= (num0 > ff->pf_last) ? 1 : -1;
+   ff->pf_last= num0;
+
+   // Leave at least half the cache for blocks already seen
+   cnt= num1 - num0;
+   if (cnt > ff->max_unref / 2 / bsiz) cnt= ff->max_unref / 2 / bsiz;
+   if (cnt <= 0) return;
+
+   if (!ff->pf) {
+      ff->pf_rd= ALLOC(BWRdr);
+      if (!(ff->pf_cond= SDL_CreateCond()))
+	 errorSDL("Couldn't create condition variable");
+      if (!(ff->pf= SDL_CreateThread(pf_main, ff)))
+	 errorSDL("Couldn't create read-ahead thread");
+   }
+
+   SDL_LockMutex(ff->lock);
+   if (cnt > ff->pf_m) {
+      if (ff->pf_want) free(ff->pf_want);
+      ff->pf_m= cnt;
+      ff->pf_want= ALLOC_ARR(cnt, int);
+   }
+
+   // Replace any previous request with the blocks we don't have yet
+   n= 0;
+   for (a= 0; a<cnt; a++) {
+      int num= (dir > 0) ? num1 + a : num0 - 1 - a;
+      if (num < 0) break;
+      if (ff->eof && num >= ff->n_blk) break;
+      if (!*hash_find(ff, num)) 
+	 ff->pf_want[n++]= num;
+   }
+   ff->pf_n= n;
+   ff->pf_i= 0;
+   if (n) SDL_CondSignal(ff->pf_cond);
+   SDL_UnlockMutex(ff->lock);
+}
+
+//
+//	Scan through to the end of the file, so that ff->len is known.
+//	Where the format has a skip routine, the packets are only
+//	stepped over, not decoded, and nothing is allocated for them.
+//
+
+void
+bwfile_find_end(BWFile *ff) {
+   if (ff->stream || ff->eof) return;
+   SDL_LockMutex(ff->lock);
+   scan_to(ff, dec_block(ff, ff->rd, -1, 0), INT_MAX);
+   SDL_UnlockMutex(ff->lock);
 }
 
 //
@@ -381,51 +1718,395 @@ bwfile_free(BWFile *ff, BWBlock *bb) {
 
 void 
 bwfile_close(BWFile *ff) {
+   int a;
+
+   // Stop the background index builder and the read-ahead and
+   // stream reader threads
+   if (ff->stream) st_stop(ff);
+   ff->bld_stop= 1;
+   bwfile_index_wait(ff);
+   if (ff->pf) {
+      SDL_LockMutex(ff->lock);
+      ff->pf_quit= 1;
+      SDL_CondSignal(ff->pf_cond);
+      SDL_UnlockMutex(ff->lock);
+      SDL_WaitThread(ff->pf, 0);
+      SDL_DestroyCond(ff->pf_cond);
+   }
+   while (ff->pf_done) {
+      BWBlock *bb= ff->pf_done;
+      ff->pf_done= bb->nxt;
+      free_block(bb);
+   }
+   if (ff->pf_want) free(ff->pf_want);
+
    // Delete all the cached blocks
-   while (ff->cache) {
-      void *vp= ff->cache;
-      ff->cache= ff->cache->nxt;
-      free(vp);
+   for (a= 0; a<ff->hash_siz; a++) {
+      while (ff->hash[a]) {
+	 BWBlock *bb= ff->hash[a];
+	 ff->hash[a]= bb->nxt;
+	 free_block(bb);
+      }
+   }
+   while (ff->dead) {
+      BWBlock *bb= ff->dead;
+      ff->dead= bb->nxt;
+      free_block(bb);
    }
+   free(ff->hash);
+
+   // Bring the sidecar index up to date
+   if (ff->n_blk != ff->idx_n_blk || ff->eof != ff->idx_eof ||
+       ff->pyr_n != ff->idx_pyr_n || gz_changed(ff))
+      save_index(ff);
 
    // Close the file
+#ifdef T_LINUX
+   if (ff->map) munmap(ff->map, ff->map_len);
+   if (ff->ino_fd >= 0) close(ff->ino_fd);
+#endif
    fclose(ff->fp);
+   if (ff->gz) gz_close(ff);
+   if (ff->part) part_close(ff);
    
    // Release any other memory
    free(ff->blk);
+   for (a= 0; a<ff->chan; a++) 
+      if (ff->pyr[a]) free(ff->pyr[a]);
+   free(ff->pyr);
+   if (ff->err_run) free(ff->err_run);
+   if (ff->ev) free(ff->ev);
+   if (ff->sw) free(ff->sw);
+   rdr_free(ff->rd);
+   if (ff->pf_rd) rdr_free(ff->pf_rd);
+   if (ff->want) free(ff->want);
+   free(ff->need);
+   if (ff->buf) free(ff->buf);
+   if (ff->idx_fnam) free(ff->idx_fnam);
+   free(ff->fmt);
+   SDL_DestroyMutex(ff->lock);
+   SDL_DestroyCond(ff->rd_cond);
    if (ff->read_data) free(ff->read_data);
    free(ff);
 }
 
+//
+//	Check whether the file has grown since it was opened, or since
+//	the last time bwfile_check_eof() picked up new data.  Where
+//	inotify is available this costs nothing unless the file has
+//	been written to; otherwise it is an fstat().  For a stream,
+//	this says whether any more has arrived.  For a file in parts,
+//	only the last part is checked.  For anything else that can't be
+//	checked, this always returns 1.
+//
+
+int 
+bwfile_grown(BWFile *ff) {
+   struct stat st;
+   long long off;
+   int rv;
+
+   if (ff->stream) {
+      SDL_LockMutex(ff->lock);
+      rv= ff->grown;
+      SDL_UnlockMutex(ff->lock);
+      return rv;
+   }
+   if (ff->grown || ff->writing) return ff->grown;
+   if (ff->chk_size < 0) return ff->grown= 1;
+
+#ifdef T_LINUX
+   if (ff->ino_fd >= 0) {
+      char buf[1024];
+      int got= 0;
+      while (read(ff->ino_fd, buf, sizeof(buf)) > 0) got= 1;
+      if (!got) return 0;
+   }
+#endif
+
+   if (0 == fstat(part_last(ff, &off), &st) && off + st.st_size > ff->chk_size) {
+      ff->chk_size= off + st.st_size;
+      ff->grown= 1;
+   }
+   return ff->grown;
+}
+
+//
+//	Take block 'num' out of the cache because it has changed in the
+//	file.  If it is still referenced, renumber it to -999 so that
+//	the caller can see it is stale, and keep it on the dead list
+//	until it is released.
+//
+
+static void 
+drop_block(BWFile *ff, int num) {
+   BWBlock *bb, **prvp;
+
+   prvp= hash_find(ff, num);
+   if ((bb= *prvp)) {
+      *prvp= bb->nxt;
+      ff->n_cache--;
+      if (bb->ref == 0) {
+	 lru_unlink(ff, bb);
+	 free_block(bb);
+      } else {
+	 bb->num= -999;
+	 bb->nxt= ff->dead;
+	 ff->dead= bb;
+      }
+   }
+}
+
 //
 //	Check to see if more data has been written to the file since
-//	we last looked.
+//	we last looked.  Does nothing unless bwfile_grown() says so.
 //
 
 void 
 bwfile_check_eof(BWFile *ff) {
-   BWBlock *bb;
+   int last;
    
-   if (!ff->eof) return;
+   if (ff->stream) {
+      st_check(ff);
+      return;
+   }
+   if (ff->writing) {
+      ff->grown= 0;	// Appends are seen straight away
+      return;
+   }
+   if (!ff->eof || !bwfile_grown(ff)) return;
+   ff->grown= 0;
 
-   ff->eof= 0;
-   ff->len= -1;
-   if (ff->n_blk == 0)
-      memset(&ff->pos, 0, sizeof(fpos_t));
-   else {
-      ff->n_blk--;
-      memcpy(&ff->pos, &ff->blk[ff->n_blk], sizeof(fpos_t));
+   SDL_LockMutex(ff->lock);
+   rdr_wait(ff);
+   pf_collect(ff);
+   ff->pf_n= 0;
+
+   // Pick up the new size of the file if it is mapped
+   if (ff->mapped) map_file(ff);
+
+   if (ff->read_blk) {
+      // Direct access formats just need the new size
+      last= ff->n_blk - 1;
+      ff->size_blk(ff);
+      ff->n_blk= ff->len / ff->bsiz + 1;
+   } else {
+      ff->eof= 0;
+      ff->len= -1;
+      if (ff->n_blk == 0)
+	 ff->pos= ff->start;
+      else {
+	 ff->n_blk--;
+	 ff->pos= ff->blk[ff->n_blk];
+      }
+      last= ff->n_blk;
    }
+   err_trunc(ff, last);
+   ev_trunc(ff, last);
+   SDL_UnlockMutex(ff->lock);
 
    // This means that the previous last block will now be re-read if
-   // fetched.  There could still be an old version knocking about in
-   // our cache, though, so renumber it to -999 so that it will not be
-   // used.
+   // fetched
+   drop_block(ff, last);
+}
 
-   for (bb= ff->cache; bb; bb= bb->nxt) {
-      if (bb->num >= ff->n_blk)
-	 bb->num= -999;
+//
+//	Append 'len' samples to a file made with bwfile_create().
+//	dat[c][] has the samples for channel 'c', and err[] the error
+//	flags, or 'err' may be 0 if there are none.  This must be
+//	called from the same thread as bwfile_get(), as it updates the
+//	cache.  Blocks already fetched keep working as for a growing
+//	file (see bwfile_check_eof()), except that there is no need to
+//	rescan anything.
+//
+
+void 
+bwfile_append(BWFile *ff, float **dat, char *err, int len) {
+   BwcInfo *bi= (BwcInfo *)ff->read_data;
+   long long pos;
+   int done, cnt;
+
+   if (!ff->writing)
+      error("Internal error -- bwfile_append() on a file not from bwfile_create()");
+   if (len <= 0) return;
+
+   SDL_LockMutex(ff->lock);
+   pf_collect(ff);
+   ff->pf_n= 0;
+
+   pos= ff->len;
+   for (done= 0; done < len; done += cnt) {
+      cnt= bi->bsiz - (pos + done) % bi->bsiz;
+      if (cnt > len - done) cnt= len - done;
+      write_bwc(ff, dat, err, done, pos + done, cnt);
+   }
+   if (0 != fflush(ff->fp))
+      error("Error writing file: %s", strerror(errno));
+
+   ff->len= pos + len;
+   ff->n_blk= ff->len / ff->bsiz + 1;
+   ff->grown= 1;
+   err_trunc(ff, pos / ff->bsiz);
+   SDL_UnlockMutex(ff->lock);
+
+   // The block holding the old end of the file has changed
+   drop_block(ff, pos / ff->bsiz);
+}
+
+//
+//	Get the number of samples read from a stream so far.  Unlike
+//	ff->len this is known before the end of the stream is reached,
+//	although only the last ff->n_ring blocks of it are still
+//	available.
+//
+
+int 
+bwfile_stream_len(BWFile *ff) {
+   int len;
+   SDL_LockMutex(ff->lock);
+   len= ff->st_len;
+   SDL_UnlockMutex(ff->lock);
+   return len;
+}
+
+//
+//	Transcode a file in any supported format into a native "bwc"
+//	file with bwfile_create(), which can then be opened with
+//	format "bwc" and read without any parsing or scanning.  If
+//	'int16' is set the data is stored as 16-bit integers, which is
+//	lossless for all the integer-based formats, but rounds
+//	floating-point data.  In that case a first pass finds the range
+//	of the data so that the scaling (1/32768 times a power of two)
+//	can be chosen to fit it.  A stream can only be read once, so
+//	this can't be done for floating-point data from a stream, but
+//	integer data is stored at the format's own scaling.
+//
+
+void 
+bwfile_transcode(char *fmt, char *fnam, char *out, int int16) {
+   BWFile *ff= open_file(fmt, &fnam, 1, BWC_BSIZ, 0, 1);
+   BWFile *wr;
+   int bsiz= BWC_BSIZ;
+   float scale= 1.0 / 32768;
+   float max= 0, min= 0;
+   float **dat= ALLOC_ARR(ff->chan, float*);
+   char *err= ALLOC_ARR(bsiz, char);
+   BWBlock *bb;
+   int num, len, a, c;
+
+   if (int16 && ff->stream) {
+      if (ff->width == 4)
+	 error("Can't store floating-point data from a stream as 16-bit integers");
+      scale= ff->scale;
+   }
+
+   for (num= 0; int16 && !ff->stream && (bb= bwfile_get(ff, num)); num++) {
+      len= bb->len;
+      for (c= 0; c<ff->chan; c++) 
+	 for (a= 0; a<len; a++) {
+	    float val= BWBLOCK_VAL(bb, c, a);
+	    if (val > max) max= val;
+	    if (val < min) min= val;
+	 }
+      bwfile_free(ff, bb);
+      if (len < bsiz) break;
+   }
+   while (!ff->stream && (max > scale * 32767 || min < scale * -32768) && scale < 1e30) 
+      scale *= 2;
+
+   wr= bwfile_create(out, ff->rate, ff->chan, int16 ? scale : 0, bsiz, 0);
+   for (c= 0; c<ff->chan; c++) 
+      dat[c]= ALLOC_ARR(bsiz, float);
+
+   for (num= 0; (bb= ff->stream ? st_get_wait(ff, num) : bwfile_get(ff, num)); num++) {
+      len= bb->len;
+      for (c= 0; c<ff->chan; c++) 
+	 for (a= 0; a<len; a++) 
+	    dat[c][a]= BWBLOCK_VAL(bb, c, a);
+      if (bb->n_err) {
+	 memset(err, 0, bsiz * sizeof(char));
+	 for (a= 0; a<bb->n_err_run; a++)
+	    memset(err + bb->err_run[a].beg, 1, 
+		   (bb->err_run[a].end - bb->err_run[a].beg) * sizeof(char));
+      }
+      bwfile_append(wr, dat, bb->n_err ? err : 0, len);
+      bwfile_free(ff, bb);
+      if (len < bsiz) break;
    }
+
+   bwfile_close(wr);
+   for (c= 0; c<ff->chan; c++) 
+      free(dat[c]);
+   free(dat);
+   free(err);
+   bwfile_close(ff);
+}
+
+//
+//	Send a file to a viewer listening on a "unix:" socket (see
+//	file_stream.inc), paced at the rate it was recorded, to test
+//	live viewing.  The file is scanned first to find its length,
+//	which gives the number of bytes to send per second.
+//
+
+void 
+bwfile_push(char *fmt, char *fnam, char *sock) {
+#ifdef T_LINUX
+   BWFile *ff= bwfile_open(fmt, fnam, 1024, 0);
+   struct sockaddr_un sa;
+   struct timeval tv0, tv;
+   unsigned char buf[65536];
+   long long off, due, hdr;
+   double bps;
+   int fd, got, a, n;
+
+   if (ff->stream)
+      error("Can't work out the rate to send a stream at: %s", fnam);
+   bwfile_index_start(ff);
+   bwfile_index_wait(ff);
+   bwfile_find_end(ff);
+   if (ff->len <= 0)
+      error("No data in file: %s", fnam);
+   hdr= ff->start;
+   bps= (file_len(ff) - hdr) * ff->rate / ff->len;
+
+   if (strlen(sock) >= sizeof(sa.sun_path))
+      error("Socket path too long: %s", sock);
+   memset(&sa, 0, sizeof(sa));
+   sa.sun_family= AF_UNIX;
+   strcpy(sa.sun_path, sock);
+   if (0 > (fd= socket(AF_UNIX, SOCK_STREAM, 0)) ||
+       0 != connect(fd, (struct sockaddr *)&sa, sizeof(sa)))
+      error("Can't connect to socket %s: %s", sock, strerror(errno));
+
+   // Send whatever is due by now, then wait a bit.  Any header goes
+   // straight away.
+   gettimeofday(&tv0, 0);
+   off= 0;
+   while (1) {
+      gettimeofday(&tv, 0);
+      due= hdr + (long long)(bps * ((tv.tv_sec - tv0.tv_sec) + 
+				    (tv.tv_usec - tv0.tv_usec) * 1e-6));
+      while (off < due) {
+	 n= (due - off > sizeof(buf)) ? sizeof(buf) : due - off;
+	 if (0 >= (got= read_file(ff, off, buf, n)))
+	    goto done;
+	 for (a= 0; a<got; ) {
+	    n= send(fd, buf + a, got - a, MSG_NOSIGNAL);
+	    if (n < 0 && errno == EINTR) continue;
+	    if (n <= 0) error("Connection to %s lost: %s", sock, strerror(errno));
+	    a += n;
+	 }
+	 off += got;
+      }
+      usleep(20000);
+   }
+ done:
+   bwfile_close(ff);
+   close(fd);
+#else
+   error("Unix-domain sockets are not supported on this system: %s", sock);
+#endif
 }
 
 //
@@ -45,6 +45,7 @@ int colour_data[]= {
    0x000000,	// 23 - white
    0x008800,	// 24 - current setting display (0x98: white on green)
    0xFFFFFF,	// 25 - white
+   0x600000,	// 26 - sparse errors on the time-line (dark red)
 };
 
 //
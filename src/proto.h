@@ -1,12 +1,21 @@
 extern inline void sincos_init(double *buf, double freq) ;
 extern inline void sincos_step(double *buf) ;
-extern BWAnal * bwanal_new(char *fmt, char *fnam) ;
+extern BWAnal * bwanal_new(char *fmt, char **fnam, int n_fnam) ;
 extern void bwanal_start(BWAnal *aa) ;
 extern void bwanal_signal(BWAnal *aa) ;
 extern void bwanal_window(BWAnal *aa, int xx, int yy) ;
 extern int bwanal_calc(BWAnal *aa) ;
 extern void bwanal_del(BWAnal *aa) ;
 extern void bwanal_recheck_file(BWAnal *aa) ;
+extern int bwanal_file_grown(BWAnal *aa) ;
+extern int bwanal_length(BWAnal *aa) ;
+extern int bwanal_index_progress(BWAnal *aa) ;
+extern int bwanal_approx_length(BWAnal *aa) ;
+extern int bwanal_approx(BWAnal *aa) ;
+extern int bwanal_next_error(BWAnal *aa, int pos, int dir, int *begp, int *endp) ;
+extern int bwanal_error_density(BWAnal *aa, int n, int *cnt) ;
+extern int bwanal_next_event(BWAnal *aa, int pos, int dir, int *posp, int *chanp, int *valp) ;
+extern int bwanal_events(BWAnal *aa, int beg, int end, BWEvt *ev, int max) ;
 extern void bwanal_load_wisdom(char *fnam) ;
 extern void bwanal_optimise(BWAnal *aa) ;
 extern void bwanal_save_wisdom(char *fnam) ;
@@ -58,6 +67,10 @@ extern void *Alloc(int size) ;
 extern void *StrDup(char *str) ;
 extern int main(int ac, char **av) ;
 extern void exec_key(BWAnal *aa, int key) ;
+extern void goto_end(BWAnal *aa) ;
+extern void goto_frac(BWAnal *aa, double frac) ;
+extern void goto_error(BWAnal *aa, int dir) ;
+extern void goto_event(BWAnal *aa, int dir) ;
 extern void show_mag_status(BWAnal *aa, int xx, int yy) ;
 extern void config_load(char *fnam) ;
 extern double config_get_fp(char *key_str) ;
@@ -70,11 +83,36 @@ extern void draw_signal(BWAnal *aa) ;
 extern void draw_timeline(BWAnal *aa) ;
 extern void draw_mag_lines(BWAnal *aa, int lin, int cnt) ;
 extern void draw_settings(BWAnal *aa) ;
+extern int bwfile_range(BWFile *ff, int chan, int num0, int num1, float *minp, float *maxp) ;
+extern int bwfile_next_error(BWFile *ff, int pos, int dir, int *begp, int *endp) ;
+extern int bwfile_error_density(BWFile *ff, int n, int *cnt) ;
+extern int bwfile_next_event(BWFile *ff, int pos, int dir, int *posp, int *chanp, int *valp) ;
+extern int bwfile_events(BWFile *ff, int beg, int end, BWEvt *ev, int max) ;
+extern void bwfile_index_start(BWFile *ff) ;
+extern int bwfile_index_progress(BWFile *ff) ;
+extern void bwfile_index_wait(BWFile *ff) ;
+extern void bwfile_approx(BWFile *ff, int on) ;
+extern int bwfile_exact(BWFile *ff, int num) ;
+extern int bwfile_approx_len(BWFile *ff) ;
+extern BWRdr *bwfile_reader(BWFile *ff) ;
+extern void bwfile_reader_free(BWRdr *rd) ;
+extern BWBlock *bwfile_read(BWFile *ff, BWRdr *rd, int num) ;
+extern void bwfile_read_free(BWBlock *bb) ;
 extern BWFile * bwfile_open(char *fmt, char *fnam, int bsiz, int max_unref) ;
+extern BWFile * bwfile_open_parts(char *fmt, char **fnams, int n_fnam, int bsiz, int max_unref) ;
+extern BWFile * bwfile_create(char *fnam, double rate, int chan, float scale, int bsiz, int max_unref) ;
 extern BWBlock * bwfile_get(BWFile *ff, int num) ;
 extern void bwfile_free(BWFile *ff, BWBlock *bb) ;
+extern void bwfile_want(BWFile *ff, char *want) ;
+extern void bwfile_readahead(BWFile *ff, int num0, int num1) ;
+extern void bwfile_find_end(BWFile *ff) ;
 extern void bwfile_close(BWFile *ff) ;
+extern int bwfile_grown(BWFile *ff) ;
 extern void bwfile_check_eof(BWFile *ff) ;
+extern void bwfile_append(BWFile *ff, float **dat, char *err, int len) ;
+extern int bwfile_stream_len(BWFile *ff) ;
+extern void bwfile_transcode(char *fmt, char *fnam, char *out, int int16) ;
+extern void bwfile_push(char *fmt, char *fnam, char *sock) ;
 extern void bwfile_list_formats(FILE *out) ;
 extern int colour_data[];
 extern int suspend_update;